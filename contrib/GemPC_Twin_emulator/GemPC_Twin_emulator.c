@@ -0,0 +1,715 @@
+/*
+ * GemPC_Twin_emulator.c: emulate a serial Gemalto reader on a pseudo-terminal
+ *
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The emulator implements the serial protocol used by src/ccid_serial.c:
+ * - SYNC (0x03) + CTRL (ACK 0x06) + CCID message + LRC framing
+ * - NAK frame (0x03 0x15 0x16) when a frame has a wrong LRC
+ * - echo of the command frame (GemPC Twin and GemPC PinPad)
+ * - RDR_to_PC_NotifySlotChange (0x50 + bmSlotIccState) injection
+ * - T=0 time request bytes (0x80) before the XfrBlock answers
+ * - the GemCore SIM Pro 2 start at 9600 bauds and the escape command
+ *   { 0x01, 0x10, 0x20 } to switch to 115200 bauds
+ *
+ * The card answers 90 00 to every APDU (and Le bytes of data for a
+ * case 2 TPDU).
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+
+#define SYNC 0x03
+#define CTRL_ACK 0x06
+#define CTRL_NAK 0x15
+#define RDR_to_PC_NotifySlotChange 0x50
+#define TIME_REQUEST 0x80
+
+#define PC_to_RDR_SetParameters 0x61
+#define PC_to_RDR_IccPowerOn 0x62
+#define PC_to_RDR_IccPowerOff 0x63
+#define PC_to_RDR_GetSlotStatus 0x65
+#define PC_to_RDR_Escape 0x6B
+#define PC_to_RDR_XfrBlock 0x6F
+
+#define RDR_to_PC_DataBlock 0x80
+#define RDR_to_PC_SlotStatus 0x81
+#define RDR_to_PC_Parameters 0x82
+#define RDR_to_PC_Escape 0x83
+
+#define ICC_PRESENT_ACTIVE 0x00
+#define ICC_PRESENT_INACTIVE 0x01
+#define ICC_ABSENT 0x02
+#define COMMAND_FAILED 0x40
+
+#define ERROR_ICC_MUTE 0xFE
+#define ERROR_CMD_NOT_SUPPORTED 0x00
+#define ERROR_BAD_SLOT 0x05
+
+#define CCID_HEADER_SIZE 10
+#define MAX_SLOTS 5
+/* 271 = max size for short APDU, as in ccid_serial.c */
+#define MAX_FRAME (2 + 271 + 1)
+
+struct reader
+{
+	const char *name;
+	int nb_slots;
+	bool echo;
+	bool start_9600;
+	const char *firmware;
+};
+
+static const struct reader readers[] = {
+	{ "GemPCTwin", 1, true, false, "GemTwin V1.00" },
+	{ "GemPCPinPad", 1, true, false, "GemPC PinPad V1.00" },
+	{ "GemCorePOSPro", 5, false, false, "GemCore POS Pro V1.00" },
+	{ "GemCoreSIMPro", 2, false, false, "GemCore SIM Pro V1.00" },
+	{ "GemCoreSIMPro2", 2, false, true, "GemCore SIM Pro 2 V1.00" },
+	{ "SEC1210", 2, false, false, "SEC1210 V1.00" },
+};
+
+/* a T=0 ATR without interface bytes */
+static const unsigned char atr[] = { 0x3B, 0x00 };
+
+static const struct reader *reader = &readers[0];
+static bool echo;
+static bool verbose = false;
+static int time_requests = 0;
+static int card_toggle = 0;
+
+static int master_fd = -1;
+static int slave_fd = -1;
+static speed_t speed = B115200;
+
+static bool card_present[MAX_SLOTS];
+static bool card_powered[MAX_SLOTS];
+static unsigned char slot_changed;
+
+static volatile sig_atomic_t toggle_requested = 0;
+static volatile sig_atomic_t terminated = 0;
+
+static unsigned long frames_in, frames_out, bytes_in, bytes_out;
+
+
+/*****************************************************************************
+ *
+ *					xxd
+ *
+ ****************************************************************************/
+static void xxd(const char *msg, const unsigned char *buffer, int length)
+{
+	int i;
+
+	if (! verbose)
+		return;
+
+	printf("%s", msg);
+	for (i=0; i<length; i++)
+		printf("%02X ", buffer[i]);
+	printf("\n");
+	fflush(stdout);
+} /* xxd */
+
+
+/*****************************************************************************
+ *
+ *					write_all
+ *
+ ****************************************************************************/
+static int write_all(const unsigned char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t rv = write(master_fd, buffer, length);
+
+		if (rv < 0)
+		{
+			if (EINTR == errno || EAGAIN == errno)
+				continue;
+
+			perror("write");
+			return -1;
+		}
+		buffer += rv;
+		length -= rv;
+		bytes_out += rv;
+	}
+
+	return 0;
+} /* write_all */
+
+
+/*****************************************************************************
+ *
+ *					send_frame: add the SYNC/ACK header and the LRC
+ *
+ ****************************************************************************/
+static int send_frame(const unsigned char *msg, int length)
+{
+	unsigned char frame[MAX_FRAME];
+	unsigned char lrc;
+	int i;
+
+	frame[0] = SYNC;
+	frame[1] = CTRL_ACK;
+	memcpy(frame+2, msg, length);
+	lrc = 0;
+	for (i=0; i<length+2; i++)
+		lrc ^= frame[i];
+	frame[length+2] = lrc;
+
+	xxd("<- ", frame, length+3);
+	frames_out++;
+
+	return write_all(frame, length+3);
+} /* send_frame */
+
+
+/*****************************************************************************
+ *
+ *					send_answer
+ *
+ ****************************************************************************/
+static int send_answer(unsigned char type, const unsigned char *cmd,
+	unsigned char status, unsigned char error, unsigned char specific,
+	const unsigned char *data, int length)
+{
+	unsigned char msg[MAX_FRAME];
+
+	if (length > MAX_FRAME - 3 - CCID_HEADER_SIZE)
+		length = MAX_FRAME - 3 - CCID_HEADER_SIZE;
+
+	msg[0] = type;
+	msg[1] = length & 0xFF;
+	msg[2] = (length >> 8) & 0xFF;
+	msg[3] = 0;
+	msg[4] = 0;
+	msg[5] = cmd[5];	/* bSlot */
+	msg[6] = cmd[6];	/* bSeq */
+	msg[7] = status;
+	msg[8] = error;
+	msg[9] = specific;
+	if (length)
+		memcpy(msg + CCID_HEADER_SIZE, data, length);
+
+	return send_frame(msg, CCID_HEADER_SIZE + length);
+} /* send_answer */
+
+
+/*****************************************************************************
+ *
+ *					icc_status
+ *
+ ****************************************************************************/
+static unsigned char icc_status(int slot)
+{
+	if (! card_present[slot])
+		return ICC_ABSENT;
+
+	return card_powered[slot] ? ICC_PRESENT_ACTIVE : ICC_PRESENT_INACTIVE;
+} /* icc_status */
+
+
+/*****************************************************************************
+ *
+ *					toggle_card: simulate a card movement
+ *
+ ****************************************************************************/
+static void toggle_card(int slot)
+{
+	card_present[slot] = ! card_present[slot];
+	card_powered[slot] = false;
+
+	/* only 4 slots fit in the bmSlotIccState byte */
+	if (slot < 4)
+		slot_changed |= 0x02 << (slot*2);
+
+	if (verbose)
+		printf("card %s in slot %d\n",
+			card_present[slot] ? "inserted" : "removed", slot);
+} /* toggle_card */
+
+
+/*****************************************************************************
+ *
+ *					notify_slot_change
+ *
+ *	The reader is configured in synchronous mode by the driver: the card
+ *	movement is notified after the host command and before the answer.
+ *
+ ****************************************************************************/
+static int notify_slot_change(void)
+{
+	unsigned char notify[2];
+	int slot;
+
+	if (0 == slot_changed)
+		return 0;
+
+	notify[0] = RDR_to_PC_NotifySlotChange;
+	notify[1] = slot_changed;
+	for (slot=0; slot<reader->nb_slots && slot<4; slot++)
+		if (card_present[slot])
+			notify[1] |= 0x01 << (slot*2);
+	slot_changed = 0;
+
+	xxd("<- ", notify, sizeof notify);
+
+	return write_all(notify, sizeof notify);
+} /* notify_slot_change */
+
+
+/*****************************************************************************
+ *
+ *					do_escape
+ *
+ ****************************************************************************/
+static int do_escape(const unsigned char *cmd, int length)
+{
+	const unsigned char *data = cmd + CCID_HEADER_SIZE;
+	int data_length = length - CCID_HEADER_SIZE;
+
+	/* get firmware */
+	if ((data_length == 1) && ((0x02 == data[0]) || (0x06 == data[0])))
+		return send_answer(RDR_to_PC_Escape, cmd, 0, 0, 0,
+			(const unsigned char *)reader->firmware,
+			strlen(reader->firmware));
+
+	/* switch to 115200 bauds */
+	if ((data_length == 3) && (0x01 == data[0]) && (0x10 == data[1])
+		&& (0x20 == data[2]))
+	{
+		int rv = send_answer(RDR_to_PC_Escape, cmd, 0, 0, 0, NULL, 0);
+
+		if (verbose)
+			printf("switch to 115200 bauds\n");
+		speed = B115200;
+		return rv;
+	}
+
+	/* card movement notification, l10n strings, APDU mode... */
+	return send_answer(RDR_to_PC_Escape, cmd, 0, 0, 0, NULL, 0);
+} /* do_escape */
+
+
+/*****************************************************************************
+ *
+ *					do_xfr_block
+ *
+ ****************************************************************************/
+static int do_xfr_block(const unsigned char *cmd, int length)
+{
+	int slot = cmd[5];
+	const unsigned char *apdu = cmd + CCID_HEADER_SIZE;
+	int apdu_length = length - CCID_HEADER_SIZE;
+	unsigned char rapdu[256 + 2];
+	int rapdu_length = 0;
+	int i;
+
+	if (! card_powered[slot])
+		return send_answer(RDR_to_PC_DataBlock, cmd,
+			COMMAND_FAILED | icc_status(slot), ERROR_ICC_MUTE, 0, NULL, 0);
+
+	/* T=0 time requests before the answer */
+	for (i=0; i<time_requests; i++)
+	{
+		unsigned char c = TIME_REQUEST;
+
+		if (write_all(&c, 1) < 0)
+			return -1;
+	}
+
+	/* case 2 TPDU: return Le bytes */
+	if (5 == apdu_length)
+	{
+		rapdu_length = apdu[4] ? apdu[4] : 256;
+		memset(rapdu, 0, rapdu_length);
+	}
+	rapdu[rapdu_length++] = 0x90;
+	rapdu[rapdu_length++] = 0x00;
+
+	return send_answer(RDR_to_PC_DataBlock, cmd, 0, 0, 0, rapdu,
+		rapdu_length);
+} /* do_xfr_block */
+
+
+/*****************************************************************************
+ *
+ *					do_command
+ *
+ ****************************************************************************/
+static int do_command(const unsigned char *cmd, int length)
+{
+	int slot = cmd[5];
+	static unsigned long nb_commands = 0;
+
+	nb_commands++;
+	if (card_toggle && (0 == nb_commands % card_toggle))
+		toggle_card(0);
+
+	if (notify_slot_change() < 0)
+		return -1;
+
+	if (slot >= reader->nb_slots)
+		return send_answer(RDR_to_PC_SlotStatus, cmd, COMMAND_FAILED,
+			ERROR_BAD_SLOT, 0, NULL, 0);
+
+	switch (cmd[0])
+	{
+		case PC_to_RDR_GetSlotStatus:
+			return send_answer(RDR_to_PC_SlotStatus, cmd, icc_status(slot),
+				0, 0, NULL, 0);
+
+		case PC_to_RDR_IccPowerOn:
+			if (! card_present[slot])
+				return send_answer(RDR_to_PC_DataBlock, cmd,
+					COMMAND_FAILED | ICC_ABSENT, ERROR_ICC_MUTE, 0, NULL, 0);
+			card_powered[slot] = true;
+			return send_answer(RDR_to_PC_DataBlock, cmd, ICC_PRESENT_ACTIVE,
+				0, 0, atr, sizeof atr);
+
+		case PC_to_RDR_IccPowerOff:
+			card_powered[slot] = false;
+			return send_answer(RDR_to_PC_SlotStatus, cmd, icc_status(slot),
+				0, 0, NULL, 0);
+
+		case PC_to_RDR_SetParameters:
+			/* accept the proposed parameters */
+			return send_answer(RDR_to_PC_Parameters, cmd, icc_status(slot),
+				0, cmd[7], cmd + CCID_HEADER_SIZE, length - CCID_HEADER_SIZE);
+
+		case PC_to_RDR_Escape:
+			return do_escape(cmd, length);
+
+		case PC_to_RDR_XfrBlock:
+			return do_xfr_block(cmd, length);
+
+		default:
+			return send_answer(RDR_to_PC_SlotStatus, cmd,
+				COMMAND_FAILED | icc_status(slot), ERROR_CMD_NOT_SUPPORTED, 0,
+				NULL, 0);
+	}
+} /* do_command */
+
+
+/*****************************************************************************
+ *
+ *					line_speed_ok: is the host at the reader speed?
+ *
+ ****************************************************************************/
+static bool line_speed_ok(void)
+{
+	struct termios t;
+
+	if (tcgetattr(slave_fd, &t) < 0)
+		return true;
+
+	return cfgetospeed(&t) == speed;
+} /* line_speed_ok */
+
+
+/*****************************************************************************
+ *
+ *					parse_frames: process the complete frames received
+ *
+ ****************************************************************************/
+static int parse_frames(unsigned char *buffer, int *length)
+{
+	int offset = 0;
+
+	while (offset < *length)
+	{
+		unsigned char *frame = buffer + offset;
+		int available = *length - offset;
+		unsigned long dwLength;
+		int frame_length;
+		unsigned char lrc;
+		int i;
+
+		/* resynchronise on SYNC */
+		if (frame[0] != SYNC)
+		{
+			offset++;
+			continue;
+		}
+
+		if (available < 2 + CCID_HEADER_SIZE)
+			break;
+
+		dwLength = frame[3] | frame[4] << 8 | frame[5] << 16
+			| (unsigned long)frame[6] << 24;
+		if (dwLength > MAX_FRAME - 3 - CCID_HEADER_SIZE)
+		{
+			fprintf(stderr, "wrong frame size: %lu\n", dwLength);
+			offset++;
+			continue;
+		}
+		frame_length = 2 + CCID_HEADER_SIZE + dwLength + 1;
+
+		if (available < frame_length)
+			break;
+
+		xxd("-> ", frame, frame_length);
+		frames_in++;
+		offset += frame_length;
+
+		/* bytes sent at the wrong speed are garbage for a real reader */
+		if (! line_speed_ok())
+		{
+			if (verbose)
+				printf("wrong line speed: frame ignored\n");
+			continue;
+		}
+
+		lrc = 0;
+		for (i=0; i<frame_length; i++)
+			lrc ^= frame[i];
+
+		if (lrc || (frame[1] != CTRL_ACK))
+		{
+			unsigned char nak[] = { SYNC, CTRL_NAK, SYNC ^ CTRL_NAK };
+
+			fprintf(stderr, "wrong LRC or CTRL: NAK\n");
+			if (write_all(nak, sizeof nak) < 0)
+				return -1;
+			continue;
+		}
+
+		if (echo && (write_all(frame, frame_length) < 0))
+			return -1;
+
+		if (do_command(frame + 2, frame_length - 3) < 0)
+			return -1;
+	}
+
+	/* keep the incomplete frame for the next read */
+	memmove(buffer, buffer + offset, *length - offset);
+	*length -= offset;
+
+	return 0;
+} /* parse_frames */
+
+
+static void sig_toggle(int sig)
+{
+	(void)sig;
+	toggle_requested = 1;
+}
+
+static void sig_terminate(int sig)
+{
+	(void)sig;
+	terminated = 1;
+}
+
+static void help(const char *argv0)
+{
+	unsigned int i;
+
+	printf("Usage: %s [-r reader] [-e|-E] [-b] [-t n] [-c n] [-l link] [-v]\n",
+		argv0);
+	printf("  -r reader: emulated reader:");
+	for (i=0; i<sizeof readers / sizeof readers[0]; i++)
+		printf(" %s", readers[i].name);
+	printf("\n");
+	printf("  -e / -E: force echo on / off\n");
+	printf("  -b: start at 115200 bauds (GemCoreSIMPro2 starts at 9600)\n");
+	printf("  -t n: send n time request bytes before each XfrBlock answer\n");
+	printf("  -c n: move the card of slot 0 every n commands\n");
+	printf("  -l link: create a symbolic link to the pseudo-terminal\n");
+	printf("  -v: dump the frames\n");
+	printf("SIGUSR1 moves the card of slot 0\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link_name = NULL;
+	const char *slave_name;
+	int force_echo = -1;
+	bool fast_start = false;
+	unsigned char buffer[4 * MAX_FRAME];
+	int length = 0;
+	int opt;
+	unsigned int i;
+	struct termios t;
+
+	while ((opt = getopt(argc, argv, "r:eEbt:c:l:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':
+				for (i=0; i<sizeof readers / sizeof readers[0]; i++)
+					if (0 == strcasecmp(optarg, readers[i].name))
+						break;
+				if (i == sizeof readers / sizeof readers[0])
+				{
+					fprintf(stderr, "unknown reader: %s\n", optarg);
+					return 1;
+				}
+				reader = &readers[i];
+				break;
+
+			case 'e':
+				force_echo = 1;
+				break;
+
+			case 'E':
+				force_echo = 0;
+				break;
+
+			case 'b':
+				fast_start = true;
+				break;
+
+			case 't':
+				time_requests = atoi(optarg);
+				break;
+
+			case 'c':
+				card_toggle = atoi(optarg);
+				break;
+
+			case 'l':
+				link_name = optarg;
+				break;
+
+			case 'v':
+				verbose = true;
+				break;
+
+			default:
+				help(argv[0]);
+				return 1;
+		}
+	}
+
+	echo = (force_echo == -1) ? reader->echo : force_echo;
+	if (reader->start_9600 && ! fast_start)
+		speed = B9600;
+
+	for (i=0; i<MAX_SLOTS; i++)
+		card_present[i] = true;
+
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((master_fd < 0) || grantpt(master_fd) || unlockpt(master_fd))
+	{
+		perror("posix_openpt");
+		return 1;
+	}
+
+	slave_name = ptsname(master_fd);
+	if (NULL == slave_name)
+	{
+		perror("ptsname");
+		return 1;
+	}
+
+	/* keep the slave opened so the pty survives the driver close() and
+	 * use it to read the line speed configured by the driver */
+	slave_fd = open(slave_name, O_RDWR | O_NOCTTY);
+	if (slave_fd < 0)
+	{
+		perror(slave_name);
+		return 1;
+	}
+	if (0 == tcgetattr(slave_fd, &t))
+	{
+		cfmakeraw(&t);
+		(void)tcsetattr(slave_fd, TCSANOW, &t);
+	}
+
+	if (link_name)
+	{
+		(void)unlink(link_name);
+		if (symlink(slave_name, link_name) < 0)
+		{
+			perror(link_name);
+			return 1;
+		}
+	}
+
+	printf("%s emulated on %s (echo: %s, %d slot(s))\n", reader->name,
+		link_name ? link_name : slave_name, echo ? "yes" : "no",
+		reader->nb_slots);
+	printf("reader.conf: DEVICENAME %s:%s\n",
+		link_name ? link_name : slave_name, reader->name);
+	fflush(stdout);
+
+	(void)signal(SIGUSR1, sig_toggle);
+	(void)signal(SIGINT, sig_terminate);
+	(void)signal(SIGTERM, sig_terminate);
+
+	while (! terminated)
+	{
+		struct pollfd pfd = { master_fd, POLLIN, 0 };
+		ssize_t rv;
+
+		if (toggle_requested)
+		{
+			toggle_requested = 0;
+			toggle_card(0);
+		}
+
+		rv = poll(&pfd, 1, 1000);
+		if (rv <= 0)
+			continue;
+
+		rv = read(master_fd, buffer + length, sizeof(buffer) - length);
+		if (rv < 0)
+		{
+			if (EINTR == errno || EAGAIN == errno || EIO == errno)
+				continue;
+
+			perror("read");
+			break;
+		}
+		bytes_in += rv;
+		length += rv;
+
+		if (parse_frames(buffer, &length) < 0)
+			break;
+
+		/* garbage filling the whole buffer */
+		if (length == sizeof(buffer))
+			length = 0;
+	}
+
+	printf("frames received: %lu (%lu bytes), frames sent: %lu (%lu bytes)\n",
+		frames_in, bytes_in, frames_out, bytes_out);
+
+	if (link_name)
+		(void)unlink(link_name);
+
+	return 0;
+}
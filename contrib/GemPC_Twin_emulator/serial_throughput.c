@@ -0,0 +1,277 @@
+/*
+ * serial_throughput.c: measure the serial transport of libccidtwin
+ *
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The driver is loaded with dlopen() like pcscd does and the IFDH API is
+ * called directly. The read(), write(), writev() and select() calls made
+ * by the driver are counted by interposing the libc functions (the
+ * program must be linked with -export-dynamic).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#include <ifdhandler.h>
+
+static _Atomic unsigned long nb_read, nb_write, nb_writev, nb_select;
+static bool verbose = false;
+
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_writev)(int, const struct iovec *, int);
+static int (*real_select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	nb_read++;
+	if (NULL == real_read)
+		real_read = (ssize_t (*)(int, void *, size_t))dlsym(RTLD_NEXT, "read");
+	return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	nb_write++;
+	if (NULL == real_write)
+		real_write = (ssize_t (*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+	return real_write(fd, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	nb_writev++;
+	if (NULL == real_writev)
+		real_writev = (ssize_t (*)(int, const struct iovec *, int))dlsym(RTLD_NEXT, "writev");
+	return real_writev(fd, iov, iovcnt);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	struct timeval *timeout)
+{
+	nb_select++;
+	if (NULL == real_select)
+		real_select = (int (*)(int, fd_set *, fd_set *, fd_set *, struct timeval *))dlsym(RTLD_NEXT, "select");
+	return real_select(nfds, readfds, writefds, exceptfds, timeout);
+}
+
+/* the driver logs using pcscd functions */
+void log_msg(const int priority, const char *fmt, ...);
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int len);
+
+void log_msg(const int priority, const char *fmt, ...)
+{
+	va_list argptr;
+
+	(void)priority;
+
+	if (! verbose)
+		return;
+
+	va_start(argptr, fmt);
+	(void)vfprintf(stderr, fmt, argptr);
+	va_end(argptr);
+	(void)fputc('\n', stderr);
+}
+
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int len)
+{
+	int i;
+
+	(void)priority;
+
+	if (! verbose)
+		return;
+
+	(void)fputs(msg, stderr);
+	for (i=0; i<len; i++)
+		(void)fprintf(stderr, "%02X ", buffer[i]);
+	(void)fputc('\n', stderr);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void help(const char *argv0)
+{
+	printf("Usage: %s [-n frames] [-l length] [-v] libccidtwin.so device[:reader]\n",
+		argv0);
+	printf("  -n frames: number of APDU exchanged (default 1000)\n");
+	printf("  -l length: number of data bytes in the APDU (default 16, max 255)\n");
+	printf("  -v: display the driver logs\n");
+}
+
+#define LOAD(name) \
+	do { \
+		p ## name = (typeof(p ## name))dlsym(handle, #name); \
+		if (NULL == p ## name) \
+		{ \
+			fprintf(stderr, "%s not found: %s\n", #name, dlerror()); \
+			return 1; \
+		} \
+	} while (0)
+
+int main(int argc, char *argv[])
+{
+	RESPONSECODE (*pIFDHCreateChannelByName)(DWORD, LPSTR);
+	RESPONSECODE (*pIFDHCloseChannel)(DWORD);
+	RESPONSECODE (*pIFDHPowerICC)(DWORD, DWORD, PUCHAR, PDWORD);
+	RESPONSECODE (*pIFDHSetProtocolParameters)(DWORD, DWORD, UCHAR, UCHAR,
+		UCHAR, UCHAR);
+	RESPONSECODE (*pIFDHTransmitToICC)(DWORD, SCARD_IO_HEADER, PUCHAR, DWORD,
+		PUCHAR, PDWORD, PSCARD_IO_HEADER);
+	void *handle;
+	unsigned char atr[MAX_ATR_SIZE];
+	DWORD atr_length = sizeof atr;
+	unsigned char apdu[5 + 255];
+	unsigned char rapdu[258];
+	/* pcscd uses 0 for T=0 in the IFDH protocol header */
+	SCARD_IO_HEADER send_pci = { 0, 0 };
+	SCARD_IO_HEADER recv_pci;
+	int frames = 1000;
+	int length = 16;
+	int opt, i;
+	double start, elapsed;
+	RESPONSECODE rv;
+	unsigned long reads, writes, writevs, selects;
+
+	while ((opt = getopt(argc, argv, "n:l:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				frames = atoi(optarg);
+				break;
+
+			case 'l':
+				length = atoi(optarg);
+				break;
+
+			case 'v':
+				verbose = true;
+				break;
+
+			default:
+				help(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((argc - optind != 2) || (frames <= 0) || (length < 1)
+		|| (length > 255))
+	{
+		help(argv[0]);
+		return 1;
+	}
+
+	handle = dlopen(argv[optind], RTLD_NOW);
+	if (NULL == handle)
+	{
+		fprintf(stderr, "dlopen: %s\n", dlerror());
+		return 1;
+	}
+
+	LOAD(IFDHCreateChannelByName);
+	LOAD(IFDHCloseChannel);
+	LOAD(IFDHPowerICC);
+	LOAD(IFDHSetProtocolParameters);
+	LOAD(IFDHTransmitToICC);
+
+	rv = pIFDHCreateChannelByName(0, argv[optind+1]);
+	if (rv != IFD_SUCCESS)
+	{
+		fprintf(stderr, "IFDHCreateChannelByName: %ld\n", rv);
+		return 1;
+	}
+
+	rv = pIFDHPowerICC(0, IFD_POWER_UP, atr, &atr_length);
+	if (rv != IFD_SUCCESS)
+	{
+		fprintf(stderr, "IFDHPowerICC: %ld\n", rv);
+		goto end;
+	}
+
+	rv = pIFDHSetProtocolParameters(0, SCARD_PROTOCOL_T0, 0, 0, 0, 0);
+	if (rv != IFD_SUCCESS)
+	{
+		fprintf(stderr, "IFDHSetProtocolParameters: %ld\n", rv);
+		goto end;
+	}
+
+	/* UPDATE BINARY with length bytes */
+	apdu[0] = 0x00;
+	apdu[1] = 0xD6;
+	apdu[2] = 0x00;
+	apdu[3] = 0x00;
+	apdu[4] = length;
+	memset(apdu + 5, 0xA5, length);
+
+	nb_read = nb_write = nb_writev = nb_select = 0;
+	start = now();
+
+	for (i=0; i<frames; i++)
+	{
+		DWORD rapdu_length = sizeof rapdu;
+
+		rv = pIFDHTransmitToICC(0, send_pci, apdu, 5 + length, rapdu,
+			&rapdu_length, &recv_pci);
+		if (rv != IFD_SUCCESS)
+		{
+			fprintf(stderr, "IFDHTransmitToICC (frame %d): %ld\n", i, rv);
+			break;
+		}
+	}
+
+	elapsed = now() - start;
+	reads = nb_read;
+	writes = nb_write;
+	writevs = nb_writev;
+	selects = nb_select;
+
+	printf("%d APDU of %d bytes in %.3f s: %.1f frames/s\n", i, 5 + length,
+		elapsed, i / elapsed);
+	if (i > 0)
+		printf("syscalls per frame: read %.2f, write %.2f, writev %.2f, select %.2f\n",
+			(double)reads / i, (double)writes / i, (double)writevs / i,
+			(double)selects / i);
+
+end:
+	(void)pIFDHCloseChannel(0);
+	(void)dlclose(handle);
+
+	return rv != IFD_SUCCESS;
+}
@@ -22,8 +22,11 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef __APPLE__
 #include <PCSC/winscard.h>
 #include <PCSC/wintypes.h>
@@ -225,6 +228,463 @@ static const char *pinpad_return_codes(int length,
 	return ret;
 }
 
+/*
+ * Benchmark mode: scardcontrol -b [options] [reader index...]
+ * Each thread loops on SCardConnect, a number of SCardTransmit with the
+ * APDU mix and SCardDisconnect(SCARD_RESET_CARD) on one of the readers.
+ */
+#define BENCH_DEFAULT_DURATION 10	/* seconds */
+#define BENCH_DEFAULT_TRANSMITS 100	/* APDU per connection */
+#define BENCH_MAX_APDUS 16
+#define BENCH_HISTOGRAM_SIZE 32	/* [2^n, 2^(n+1)[ microseconds */
+
+struct bench_apdu
+{
+	unsigned char data[MAX_BUFFER_SIZE];
+	DWORD length;
+};
+
+struct bench_latency
+{
+	unsigned long count;
+	unsigned long long total, min, max;	/* microseconds */
+	unsigned long histogram[BENCH_HISTOGRAM_SIZE];
+};
+
+struct bench_reader
+{
+	const char *name;
+	pthread_mutex_t mutex;
+	struct bench_latency connect, transmit, disconnect;
+	unsigned long errors;
+	int threads;
+	double elapsed;	/* seconds, sum of all the threads */
+};
+
+struct bench_thread
+{
+	pthread_t thread;
+	struct bench_reader *reader;
+	const struct bench_apdu *apdus;
+	int nb_apdus;
+	int duration;
+	int transmits;
+};
+
+static unsigned long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+} /* bench_now */
+
+static void bench_add(struct bench_latency *latency, unsigned long long us)
+{
+	int bucket = 0;
+
+	if ((0 == latency->count) || (us < latency->min))
+		latency->min = us;
+	if (us > latency->max)
+		latency->max = us;
+	latency->count++;
+	latency->total += us;
+
+	while ((us >> (bucket+1)) && (bucket < BENCH_HISTOGRAM_SIZE-1))
+		bucket++;
+	latency->histogram[bucket]++;
+} /* bench_add */
+
+static void bench_merge(struct bench_latency *to,
+	const struct bench_latency *from)
+{
+	int i;
+
+	if (0 == from->count)
+		return;
+
+	if ((0 == to->count) || (from->min < to->min))
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->count += from->count;
+	to->total += from->total;
+	for (i=0; i<BENCH_HISTOGRAM_SIZE; i++)
+		to->histogram[i] += from->histogram[i];
+} /* bench_merge */
+
+/* upper bound of the bucket containing the given percentile */
+static unsigned long long bench_percentile(const struct bench_latency *latency,
+	int percent)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i=0; i<BENCH_HISTOGRAM_SIZE; i++)
+	{
+		n += latency->histogram[i];
+		if (n * 100 >= latency->count * percent)
+			break;
+	}
+
+	return 2ULL << i;
+} /* bench_percentile */
+
+static void bench_print(const char *phase, const struct bench_latency *latency)
+{
+	int i;
+
+	if (0 == latency->count)
+	{
+		printf(" %-10s: no call\n", phase);
+		return;
+	}
+
+	printf(" %-10s: " GREEN "%lu" NORMAL " calls, mean " GREEN "%llu" NORMAL
+		" us, min %llu us, max %llu us, p50 < %llu us, p99 < %llu us\n",
+		phase, latency->count, latency->total / latency->count,
+		latency->min, latency->max, bench_percentile(latency, 50),
+		bench_percentile(latency, 99));
+
+	for (i=0; i<BENCH_HISTOGRAM_SIZE; i++)
+		if (latency->histogram[i])
+			printf("  [%8llu, %8llu[ us: %lu\n", i ? 1ULL << i : 0,
+				2ULL << i, latency->histogram[i]);
+} /* bench_print */
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bench = arg;
+	struct bench_reader *reader = bench->reader;
+	struct bench_latency connect = { 0 }, transmit = { 0 }, disconnect = { 0 };
+	unsigned long errors = 0;
+	unsigned long long start, deadline, t;
+	SCARDCONTEXT hContext;
+	LONG rv;
+	int apdu = 0;
+
+	/* one context per thread */
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		printf("SCardEstablishContext: " RED "%s (0x%"LF"X)\n" NORMAL,
+			pcsc_stringify_error(rv), rv);
+		return NULL;
+	}
+
+	start = bench_now();
+	deadline = start + bench->duration * 1000000ULL;
+
+	while (bench_now() < deadline)
+	{
+		SCARDHANDLE hCard;
+		DWORD dwActiveProtocol;
+		const SCARD_IO_REQUEST *pioSendPci;
+		int i;
+
+		t = bench_now();
+		rv = SCardConnect(hContext, reader->name, SCARD_SHARE_SHARED,
+			SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &dwActiveProtocol);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			/* no card or reader removed: do not loop on the error */
+			printf("%s: SCardConnect: " RED "%s (0x%"LF"X)\n" NORMAL,
+				reader->name, pcsc_stringify_error(rv), rv);
+			errors++;
+			break;
+		}
+		bench_add(&connect, bench_now() - t);
+
+		/* the threads on the same reader take turns. The card reset by
+		 * the SCardDisconnect() of another thread is reported once */
+		rv = SCardBeginTransaction(hCard);
+		if (SCARD_W_RESET_CARD == rv)
+		{
+			rv = SCardReconnect(hCard, SCARD_SHARE_SHARED,
+				SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD,
+				&dwActiveProtocol);
+			if (SCARD_S_SUCCESS == rv)
+				rv = SCardBeginTransaction(hCard);
+		}
+		if (rv != SCARD_S_SUCCESS)
+		{
+			printf("%s: SCardBeginTransaction: " RED "%s (0x%"LF"X)\n" NORMAL,
+				reader->name, pcsc_stringify_error(rv), rv);
+			errors++;
+			(void)SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+			break;
+		}
+
+		pioSendPci = (SCARD_PROTOCOL_T0 == dwActiveProtocol) ?
+			SCARD_PCI_T0 : SCARD_PCI_T1;
+
+		for (i=0; (i<bench->transmits) && (bench_now() < deadline); i++)
+		{
+			unsigned char bRecvBuffer[MAX_BUFFER_SIZE];
+			DWORD length = sizeof(bRecvBuffer);
+
+			t = bench_now();
+			rv = SCardTransmit(hCard, pioSendPci, bench->apdus[apdu].data,
+				bench->apdus[apdu].length, NULL, bRecvBuffer, &length);
+			if (rv != SCARD_S_SUCCESS)
+			{
+				errors++;
+				break;
+			}
+			bench_add(&transmit, bench_now() - t);
+
+			apdu = (apdu + 1) % bench->nb_apdus;
+		}
+
+		/* still in the transaction: no other thread uses the card
+		 * while it is reset */
+		t = bench_now();
+		rv = SCardDisconnect(hCard, SCARD_RESET_CARD);
+		if (rv != SCARD_S_SUCCESS)
+			errors++;
+		else
+			bench_add(&disconnect, bench_now() - t);
+	}
+
+	(void)SCardReleaseContext(hContext);
+
+	pthread_mutex_lock(&reader->mutex);
+	bench_merge(&reader->connect, &connect);
+	bench_merge(&reader->transmit, &transmit);
+	bench_merge(&reader->disconnect, &disconnect);
+	reader->errors += errors;
+	reader->threads++;
+	reader->elapsed += (bench_now() - start) / 1e6;
+	pthread_mutex_unlock(&reader->mutex);
+
+	return NULL;
+} /* bench_thread */
+
+/* hexadecimal APDU, like "00A4040000" or "00:A4:04:00:00" */
+static bool bench_parse_apdu(const char *hex, struct bench_apdu *apdu)
+{
+	apdu->length = 0;
+	while (*hex)
+	{
+		unsigned int value;
+
+		if ((':' == *hex) || (' ' == *hex))
+		{
+			hex++;
+			continue;
+		}
+
+		if ((apdu->length >= sizeof(apdu->data))
+			|| !isxdigit((unsigned char)hex[0])
+			|| !isxdigit((unsigned char)hex[1])
+			|| (1 != sscanf(hex, "%2x", &value)))
+			return false;
+
+		apdu->data[apdu->length++] = value;
+		hex += 2;
+	}
+
+	return apdu->length >= 4;
+} /* bench_parse_apdu */
+
+static void bench_usage(void)
+{
+	printf("Usage: scardcontrol -b [-d seconds] [-t threads] [-n transmits] [-a APDU]... [reader index...]\n");
+	printf("  -d: duration of the test (default %d s)\n", BENCH_DEFAULT_DURATION);
+	printf("  -t: number of threads, spread over the readers (default 1 per reader)\n");
+	printf("      the threads on the same reader take turns using a transaction\n");
+	printf("  -n: number of APDU per connection (default %d)\n", BENCH_DEFAULT_TRANSMITS);
+	printf("  -a: APDU in hexadecimal, repeat to use a mix (default SELECT and GET CHALLENGE)\n");
+	printf("  all the readers are used if no reader index is given\n");
+} /* bench_usage */
+
+static int benchmark(int argc, char *argv[])
+{
+	LONG rv;
+	SCARDCONTEXT hContext;
+	DWORD dwReaders;
+	LPSTR mszReaders = NULL;
+	char *ptr, **readers = NULL;
+	int nbReaders = 0;
+	struct bench_reader *bench_readers = NULL;
+	struct bench_thread *threads = NULL;
+	struct bench_apdu apdus[BENCH_MAX_APDUS];
+	int nb_apdus = 0, nb_selected, nb_threads = 0;
+	int duration = BENCH_DEFAULT_DURATION;
+	int transmits = BENCH_DEFAULT_TRANSMITS;
+	int opt, i, ret = 1;
+
+	while ((opt = getopt(argc, argv, "d:t:n:a:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':
+				duration = atoi(optarg);
+				break;
+
+			case 't':
+				nb_threads = atoi(optarg);
+				break;
+
+			case 'n':
+				transmits = atoi(optarg);
+				break;
+
+			case 'a':
+				if ((nb_apdus >= BENCH_MAX_APDUS)
+					|| !bench_parse_apdu(optarg, &apdus[nb_apdus]))
+				{
+					printf("Wrong APDU: %s\n", optarg);
+					return 1;
+				}
+				nb_apdus++;
+				break;
+
+			default:
+				bench_usage();
+				return 1;
+		}
+	}
+
+	if ((duration <= 0) || (transmits <= 0) || (nb_threads < 0))
+	{
+		bench_usage();
+		return 1;
+	}
+
+	if (0 == nb_apdus)
+	{
+		/* SELECT of the default application and GET CHALLENGE: the
+		 * status words do not matter, only the round trip */
+		(void)bench_parse_apdu("00A4040000", &apdus[nb_apdus++]);
+		(void)bench_parse_apdu("0084000008", &apdus[nb_apdus++]);
+	}
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		printf("SCardEstablishContext: Cannot Connect to Resource Manager %"LF"X\n", rv);
+		return 1;
+	}
+
+	/* Retrieve the available readers list */
+	dwReaders = SCARD_AUTOALLOCATE;
+	rv = SCardListReaders(hContext, NULL, (LPSTR)&mszReaders, &dwReaders);
+	PCSC_ERROR_EXIT(rv, "SCardListReaders")
+
+	for (ptr = mszReaders; *ptr != '\0'; ptr += strlen(ptr)+1)
+		nbReaders++;
+
+	readers = calloc(nbReaders, sizeof(char *));
+	bench_readers = calloc(nbReaders, sizeof(*bench_readers));
+	if ((NULL == readers) || (NULL == bench_readers))
+	{
+		printf("Not enough memory for readers[]\n");
+		goto end;
+	}
+
+	nbReaders = 0;
+	for (ptr = mszReaders; *ptr != '\0'; ptr += strlen(ptr)+1)
+		readers[nbReaders++] = ptr;
+
+	/* selected readers */
+	nb_selected = 0;
+	if (optind < argc)
+	{
+		for (i=optind; i<argc; i++)
+		{
+			int reader_nb = atoi(argv[i]);
+			int j;
+
+			if (reader_nb < 0 || reader_nb >= nbReaders)
+			{
+				printf("Wrong reader index: %d\n", reader_nb);
+				goto end;
+			}
+
+			/* bench_readers[] has one entry per reader */
+			for (j=0; j<nb_selected; j++)
+				if (bench_readers[j].name == readers[reader_nb])
+					break;
+			if (j < nb_selected)
+			{
+				printf("Duplicate reader index: %d\n", reader_nb);
+				goto end;
+			}
+			bench_readers[nb_selected++].name = readers[reader_nb];
+		}
+	}
+	else
+		for (i=0; i<nbReaders; i++)
+			bench_readers[nb_selected++].name = readers[i];
+
+	if (0 == nb_threads)
+		nb_threads = nb_selected;
+
+	threads = calloc(nb_threads, sizeof(*threads));
+	if (NULL == threads)
+	{
+		printf("Not enough memory for threads[]\n");
+		goto end;
+	}
+
+	for (i=0; i<nb_selected; i++)
+		pthread_mutex_init(&bench_readers[i].mutex, NULL);
+
+	printf("%d thread(s) on %d reader(s) for %d s, %d APDU per connection\n\n",
+		nb_threads, nb_selected, duration, transmits);
+
+	for (i=0; i<nb_threads; i++)
+	{
+		threads[i].reader = &bench_readers[i % nb_selected];
+		threads[i].apdus = apdus;
+		threads[i].nb_apdus = nb_apdus;
+		threads[i].duration = duration;
+		threads[i].transmits = transmits;
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]))
+		{
+			printf("pthread_create failed\n");
+			nb_threads = i;
+			break;
+		}
+	}
+
+	for (i=0; i<nb_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	for (i=0; i<nb_selected; i++)
+	{
+		struct bench_reader *reader = &bench_readers[i];
+
+		printf("Reader: " GREEN "%s\n" NORMAL, reader->name);
+		bench_print("connect", &reader->connect);
+		bench_print("transmit", &reader->transmit);
+		bench_print("disconnect", &reader->disconnect);
+		if (reader->elapsed > 0)
+			printf(" throughput: " GREEN "%.1f" NORMAL " APDU/s (%.1f per thread)\n",
+				reader->transmit.count * reader->threads / reader->elapsed,
+				reader->transmit.count / reader->elapsed);
+		if (reader->errors)
+			printf(" errors: " RED "%lu\n" NORMAL, reader->errors);
+		printf("\n");
+
+		pthread_mutex_destroy(&reader->mutex);
+	}
+
+	ret = 0;
+
+end:
+	if (mszReaders)
+		(void)SCardFreeMemory(hContext, mszReaders);
+	(void)SCardReleaseContext(hContext);
+
+	free(readers);
+	free(bench_readers);
+	free(threads);
+
+	return ret;
+} /* benchmark */
+
 int main(int argc, char *argv[])
 {
 	LONG rv;
@@ -272,6 +732,9 @@ int main(int argc, char *argv[])
 	 */
 	int bEntryValidationCondition = 7;
 
+	if ((argc > 1) && (0 == strcmp(argv[1], "-b")))
+		return benchmark(argc-1, argv+1);
+
 	printf("SCardControl sample code\n");
 	printf("V 1.4 © 2004-2010, Ludovic Rousseau <ludovic.rousseau@free.fr>\n\n");
 
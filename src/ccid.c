@@ -46,6 +46,104 @@
 #include <CoreFoundation/CoreFoundation.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * Readers announcing TPDU but able to work at a higher exchange level
+ * once switched with an Escape command
+ */
+static const struct
+{
+	int readerID;
+	unsigned char cmd[2];
+	unsigned int dwExchangeLevel;
+} ExchangeLevelSwitch[] =
+{
+	/* the APDU mode is also an EMV mode so may not work with non EMV cards
+	 * Only used with DRIVER_OPTION_GEMPC_TWIN_KEY_APDU */
+	{ GEMPCKEY, { 0x1F, ESC_GEMPC_SET_APDU_MODE }, CCID_CLASS_SHORT_APDU },
+	{ GEMPCTWIN, { 0x1F, ESC_GEMPC_SET_APDU_MODE }, CCID_CLASS_SHORT_APDU },
+};
+
+/*
+ * Reader models and firmware versions (readerID and bcdDevice) that
+ * refused the switch, so they are not asked again. Also loaded from the
+ * ifdExchangeLevelRefused Info.plist key to survive a pcscd restart
+ */
+#define EXCHANGE_LEVEL_REFUSED_SIZE 8
+static struct
+{
+	int readerID;	/* 0 for an unused entry */
+	int bcdDevice;
+} ExchangeLevelRefused[EXCHANGE_LEVEL_REFUSED_SIZE];
+static int ExchangeLevelRefusedNext;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t ExchangeLevelMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*****************************************************************************
+ *
+ *					ccid_get_quirks
+ *
+ ****************************************************************************/
+unsigned int ccid_get_quirks(int readerID, int bcdDevice)
+{
+	unsigned int quirks = 0;
+
+	switch (readerID)
+	{
+		case KOBIL_IDTOKEN:
+			/* The German eID card is bogus and need to be powered off
+			 * before a power on */
+			quirks = QUIRK_IDTOKEN_PSEUDO_APDU | QUIRK_POWER_OFF_BEFORE_ON;
+			break;
+
+		case GEMCORESIMPRO:
+			/* The reader always reports a card present */
+			quirks = QUIRK_ABSENT_ON_POWER_FAILURE;
+
+			/* GemCore SIM Pro firmware 2.00 and up features
+			 * a full independent second slot */
+			if (bcdDevice < 0x0200)
+				quirks |= QUIRK_SIMULATED_SLOT_STATUS;
+			break;
+
+#ifdef __APPLE__
+		case MICROCHIP_SEC1100:
+			quirks = QUIRK_INTERRUPT_BEFORE_STATUS;
+			break;
+#endif
+
+		/* Composite readers simulated as multi-slot readers with
+		 * USE_COMPOSITE_AS_MULTISLOT. Each CCID interface has its own
+		 * USB handle, endpoints and bSeq */
+		case HID_OMNIKEY_5422:
+		case ALCOR_LINK_AK9567:
+		case ALCOR_LINK_AK9572:
+		case ACS_WALLETMATE:
+		case ACS_ACR1251:
+		case ACS_ACR1252:
+		case ACS_ACR1252IMP:
+		case ACS_ACR1581:
+		case FEITIANR502DUAL:
+			/* independent contact and contactless chips */
+			quirks = QUIRK_COMPOSITE_CONCURRENT;
+			break;
+
+		case GEMALTOPROXDU:
+		case GEMALTOPROXSU:
+			/* the reader enters a dead lock if the two CCID interfaces
+			 * are used at the same time */
+			quirks = QUIRK_COMPOSITE_EXCLUSIVE;
+			break;
+	}
+
+	return quirks;
+} /* ccid_get_quirks */
+
+
 /*****************************************************************************
  *
  *					ccid_open_hack_pre
@@ -55,6 +153,13 @@ int ccid_open_hack_pre(unsigned int reader_index)
 {
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
 
+	/* resolve the quirks once instead of testing readerID on each
+	 * command */
+	ccid_descriptor->dwQuirks = ccid_get_quirks(ccid_descriptor->readerID,
+		ccid_descriptor->IFD_bcdDevice);
+
+	ccid_descriptor->bDeferredInit = false;
+
 	switch (ccid_descriptor->readerID)
 	{
 		case MYSMARTPAD:
@@ -62,8 +167,17 @@ int ccid_open_hack_pre(unsigned int reader_index)
 			break;
 
 		case CL1356D:
-			/* the firmware needs some time to initialize */
-			(void)sleep(1);
+			/* the firmware needs some time to initialize
+			 * wait until it answers instead of a fixed 1 second */
+			{
+				unsigned char pcbuffer[SIZE_GET_SLOT_STATUS];
+				int i;
+
+				ccid_descriptor->readTimeout = 100;
+				for (i=0; i<10; i++)
+					if (IFD_SUCCESS == CmdGetSlotStatus(reader_index, pcbuffer))
+						break;
+			}
 			ccid_descriptor->readTimeout = 60*1000; /* 60 seconds */
 			break;
 
@@ -278,33 +392,117 @@ static void set_gemalto_firmware_features(unsigned int reader_index)
 
 /*****************************************************************************
  *
- *					ccid_open_hack_post
+ *					switch_exchange_level
  *
  ****************************************************************************/
-int ccid_open_hack_post(unsigned int reader_index)
+static void switch_exchange_level(unsigned int reader_index)
 {
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
-	RESPONSECODE return_value = IFD_SUCCESS;
+	unsigned char cmd[sizeof ExchangeLevelSwitch[0].cmd];
+	unsigned char res[10];
+	unsigned int length_res = sizeof(res);
+	unsigned int i;
+	bool refused = false;
+	RESPONSECODE ret;
 
-	switch (ccid_descriptor->readerID)
+	for (i=0; i<sizeof(ExchangeLevelSwitch)/sizeof(ExchangeLevelSwitch[0]); i++)
+		if (ExchangeLevelSwitch[i].readerID == ccid_descriptor->readerID)
+			break;
+
+	/* no known switch for this reader */
+	if (i >= sizeof(ExchangeLevelSwitch)/sizeof(ExchangeLevelSwitch[0]))
+		return;
+
+	/* already refused by the same model and firmware? */
+#ifdef HAVE_PTHREAD
+	(void)pthread_mutex_lock(&ExchangeLevelMutex);
+#endif
 	{
-		case GEMPCKEY:
-		case GEMPCTWIN:
-			/* Reader announces TPDU but can do APDU (EMV in fact) */
-			if (DriverOptions & DRIVER_OPTION_GEMPC_TWIN_KEY_APDU)
-			{
-				unsigned char cmd[] = { 0x1F, 0x02 };
-				unsigned char res[10];
-				unsigned int length_res = sizeof(res);
+		int j;
 
-				if (CmdEscape(reader_index, cmd, sizeof(cmd), res, &length_res, 0) == IFD_SUCCESS)
-				{
-					ccid_descriptor->dwFeatures &= ~CCID_CLASS_EXCHANGE_MASK;
-					ccid_descriptor->dwFeatures |= CCID_CLASS_SHORT_APDU;
-				}
-			}
-			break;
+		for (j=0; j<EXCHANGE_LEVEL_REFUSED_SIZE; j++)
+			if ((ExchangeLevelRefused[j].readerID == ccid_descriptor->readerID)
+				&& (ExchangeLevelRefused[j].bcdDevice == ccid_descriptor->IFD_bcdDevice))
+				refused = true;
+	}
+#ifdef HAVE_PTHREAD
+	(void)pthread_mutex_unlock(&ExchangeLevelMutex);
+#endif
 
+	if (refused)
+	{
+		DEBUG_INFO2("Exchange level switch refused by firmware 0x%04X",
+			ccid_descriptor->IFD_bcdDevice);
+		return;
+	}
+
+	memcpy(cmd, ExchangeLevelSwitch[i].cmd, sizeof(cmd));
+	ret = CmdEscapeCheck(reader_index, cmd, sizeof(cmd), res, &length_res, 0,
+		true);
+	if (IFD_SUCCESS == ret)
+	{
+		ccid_descriptor->dwFeatures &= ~CCID_CLASS_EXCHANGE_MASK;
+		ccid_descriptor->dwFeatures |= ExchangeLevelSwitch[i].dwExchangeLevel;
+		return;
+	}
+
+	/* timeout or transport error: try again with the next reader */
+	if (IFD_ERROR_NOT_SUPPORTED != ret)
+		return;
+
+	/* remember the refusal (bError) for the next reader of this model */
+	ccid_exchange_level_refused(ccid_descriptor->readerID,
+		ccid_descriptor->IFD_bcdDevice);
+
+	DEBUG_INFO3("Add <string>0x%08X/0x%04X</string> to the ifdExchangeLevelRefused key of Info.plist to remember the refusal",
+		ccid_descriptor->readerID, ccid_descriptor->IFD_bcdDevice);
+} /* switch_exchange_level */
+
+
+/*****************************************************************************
+ *
+ *					ccid_exchange_level_refused
+ *
+ ****************************************************************************/
+void ccid_exchange_level_refused(int readerID, int bcdDevice)
+{
+#ifdef HAVE_PTHREAD
+	(void)pthread_mutex_lock(&ExchangeLevelMutex);
+#endif
+	ExchangeLevelRefused[ExchangeLevelRefusedNext].readerID = readerID;
+	ExchangeLevelRefused[ExchangeLevelRefusedNext].bcdDevice = bcdDevice;
+	ExchangeLevelRefusedNext = (ExchangeLevelRefusedNext + 1)
+		% EXCHANGE_LEVEL_REFUSED_SIZE;
+#ifdef HAVE_PTHREAD
+	(void)pthread_mutex_unlock(&ExchangeLevelMutex);
+#endif
+} /* ccid_exchange_level_refused */
+
+
+/*****************************************************************************
+ *
+ *					ccid_open_hack_deferred
+ *
+ *	One time setup not needed to use the reader, done before the first
+ *	command that needs it instead of at open. The time of the setup is
+ *	added to this first command: the first PIN verification or
+ *	modification of a GemPC Pinpad or Vega Alpha includes the upload
+ *	of the l10n strings.
+ *
+ ****************************************************************************/
+int ccid_open_hack_deferred(unsigned int reader_index)
+{
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+	RESPONSECODE return_value = IFD_SUCCESS;
+
+	if (! ccid_descriptor->bDeferredInit)
+		return return_value;
+
+	/* done only once, even if it fails */
+	ccid_descriptor->bDeferredInit = false;
+
+	switch (ccid_descriptor->readerID)
+	{
 		case VEGAALPHA:
 		case GEMPCPINPAD:
 			/* load the l10n strings in the pinpad memory */
@@ -481,7 +679,6 @@ int ccid_open_hack_post(unsigned int reader_index)
 						cmd[offset++] = ' ';
 				}
 
-				(void)sleep(1);
 				if (IFD_SUCCESS == CmdEscape(reader_index, cmd, sizeof(cmd), res, &length_res, DEFAULT_COM_READ_TIMEOUT))
 				{
 					DEBUG_COMM("l10n string loaded successfully");
@@ -508,6 +705,37 @@ int ccid_open_hack_post(unsigned int reader_index)
 				}
 			}
 			break;
+	}
+
+	return return_value;
+} /* ccid_open_hack_deferred */
+
+
+/*****************************************************************************
+ *
+ *					ccid_open_hack_post
+ *
+ ****************************************************************************/
+int ccid_open_hack_post(unsigned int reader_index)
+{
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+	RESPONSECODE return_value = IFD_SUCCESS;
+
+	switch (ccid_descriptor->readerID)
+	{
+		case GEMPCKEY:
+		case GEMPCTWIN:
+			/* Reader announces TPDU but can do APDU (EMV in fact) */
+			if (DriverOptions & DRIVER_OPTION_GEMPC_TWIN_KEY_APDU)
+				switch_exchange_level(reader_index);
+			break;
+
+		case VEGAALPHA:
+		case GEMPCPINPAD:
+			/* the l10n strings are loaded in the pinpad memory before
+			 * the first PIN command, see ccid_open_hack_deferred() */
+			ccid_descriptor->bDeferredInit = true;
+			break;
 
 		case HPSMARTCARDKEYBOARD:
 		case HP_CCIDSMARTCARDKEYBOARD:
@@ -621,6 +849,9 @@ int ccid_open_hack_post(unsigned int reader_index)
 	if (GET_VENDOR(ccid_descriptor->readerID) == VENDOR_GEMALTO)
 		set_gemalto_firmware_features(reader_index);
 
+	/* the exchange level is now known */
+	SetXfrBlock(reader_index);
+
 	return return_value;
 } /* ccid_open_hack_post */
 
@@ -18,6 +18,7 @@
 */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct
 {
@@ -114,6 +115,41 @@ typedef struct
 	 */
 	int bNumEndpoints;
 
+	/*
+	 * bSeq of the last XfrBlock command sent by CCID_Transmit() for this
+	 * slot. pbSeq is shared by all the slots of the reader
+	 */
+	int xfrSeq;
+
+	/*
+	 * Response time of the XfrBlock commands, for
+	 * DRIVER_OPTION_ADAPTIVE_TIMEOUT: start time of the current command,
+	 * smoothed average and mean deviation, values are microseconds
+	 */
+	uint64_t xfrStart;
+	unsigned int xfrLatency;
+	unsigned int xfrLatencyDeviation;
+	unsigned int xfrLatencySamples;
+
+	/*
+	 * the reader did not answer a PC_to_RDR_Abort: do not abort the
+	 * next timed out commands
+	 */
+	bool bAbortFailed;
+
+	/*
+	 * ICCD: busy time learned from the previous commands
+	 * value is microseconds
+	 */
+	unsigned int iccdBusyTime;
+
+	/*
+	 * ICCD version B: INS of the current command and busy time learned
+	 * for each INS (0 if not yet known), value is microseconds
+	 */
+	unsigned char iccdIns;
+	unsigned int iccdBusyTimeIns[256];
+
 	/*
 	 * GemCore SIM PRO slot status management
 	 * The reader always reports a card present even if no card is inserted.
@@ -122,6 +158,17 @@ typedef struct
 	 */
 	int dwSlotStatus;
 
+	/*
+	 * Reader specific behaviours (QUIRK_* bit field)
+	 * resolved once at open by ccid_open_hack_pre()
+	 */
+	unsigned int dwQuirks;
+
+	/*
+	 * ccid_open_hack_deferred() still has to be called (boolean)
+	 */
+	bool bDeferredInit;
+
 	/*
 	 * bVoltageSupport (bit field)
 	 * 1 = 5.0V
@@ -130,6 +177,12 @@ typedef struct
 	 */
 	int bVoltageSupport;
 
+	/*
+	 * voltage (VOLTAGE_*) of the last successful power on
+	 * -1 if not yet known
+	 */
+	int learnedVoltage;
+
 	/*
 	 * USB serial number of the device (if any)
 	 */
@@ -172,6 +225,15 @@ typedef struct
 #define CCID_CLASS_EXTENDED_APDU	0x00040000
 #define CCID_CLASS_EXCHANGE_MASK	0x00070000
 
+/* Reader quirks from dwQuirks */
+#define QUIRK_IDTOKEN_PSEUDO_APDU	0x01	/* Kobil IDToken information APDUs */
+#define QUIRK_POWER_OFF_BEFORE_ON	0x02	/* power off before a power on */
+#define QUIRK_SIMULATED_SLOT_STATUS	0x04	/* use dwSlotStatus instead of GetSlotStatus */
+#define QUIRK_ABSENT_ON_POWER_FAILURE	0x08	/* failed power on means no card */
+#define QUIRK_INTERRUPT_BEFORE_STATUS	0x10	/* read the interrupt endpoint first */
+#define QUIRK_COMPOSITE_CONCURRENT	0x20	/* CCID interfaces usable at the same time */
+#define QUIRK_COMPOSITE_EXCLUSIVE	0x40	/* CCID interfaces NOT usable at the same time */
+
 /* Features from bPINSupport */
 #define CCID_CLASS_PIN_VERIFY		0x01
 #define CCID_CLASS_PIN_MODIFY		0x02
@@ -288,8 +350,11 @@ typedef struct
 #define VOLTAGE_3V 2
 #define VOLTAGE_1_8V 3
 
+unsigned int ccid_get_quirks(int readerID, int bcdDevice);
 int ccid_open_hack_pre(unsigned int reader_index);
 int ccid_open_hack_post(unsigned int reader_index);
+int ccid_open_hack_deferred(unsigned int reader_index);
+void ccid_exchange_level_refused(int readerID, int bcdDevice);
 void ccid_error(int log_level, int error, const char *file, int line,
 	const char *function);
 _ccid_descriptor *get_ccid_descriptor(unsigned int reader_index);
@@ -23,6 +23,18 @@
 #define IOCTL_SMARTCARD_VENDOR_IFD_EXCHANGE	SCARD_CTL_CODE(1)
 
 #define CLASS2_IOCTL_MAGIC 0x330000
+#define IOCTL_FEATURE_VERIFY_PIN_START \
+	SCARD_CTL_CODE(FEATURE_VERIFY_PIN_START + CLASS2_IOCTL_MAGIC)
+#define IOCTL_FEATURE_VERIFY_PIN_FINISH \
+	SCARD_CTL_CODE(FEATURE_VERIFY_PIN_FINISH + CLASS2_IOCTL_MAGIC)
+#define IOCTL_FEATURE_MODIFY_PIN_START \
+	SCARD_CTL_CODE(FEATURE_MODIFY_PIN_START + CLASS2_IOCTL_MAGIC)
+#define IOCTL_FEATURE_MODIFY_PIN_FINISH \
+	SCARD_CTL_CODE(FEATURE_MODIFY_PIN_FINISH + CLASS2_IOCTL_MAGIC)
+#define IOCTL_FEATURE_GET_KEY_PRESSED \
+	SCARD_CTL_CODE(FEATURE_GET_KEY_PRESSED + CLASS2_IOCTL_MAGIC)
+#define IOCTL_FEATURE_ABORT \
+	SCARD_CTL_CODE(FEATURE_ABORT + CLASS2_IOCTL_MAGIC)
 #define IOCTL_FEATURE_VERIFY_PIN_DIRECT \
 	SCARD_CTL_CODE(FEATURE_VERIFY_PIN_DIRECT + CLASS2_IOCTL_MAGIC)
 #define IOCTL_FEATURE_MODIFY_PIN_DIRECT \
@@ -34,10 +46,25 @@
 #define IOCTL_FEATURE_GET_TLV_PROPERTIES \
 	SCARD_CTL_CODE(FEATURE_GET_TLV_PROPERTIES + CLASS2_IOCTL_MAGIC)
 
+/*
+ * Vendor attributes returning a struct ccid_latency (see counters.h)
+ * and, with SCardSetAttrib(), clearing the three histograms
+ */
+#define SCARD_ATTR_CCID_LATENCY_RESET \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xCC00)
+#define SCARD_ATTR_CCID_LATENCY_TRANSMIT \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xCC01)
+#define SCARD_ATTR_CCID_LATENCY_POWER \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xCC02)
+#define SCARD_ATTR_CCID_LATENCY_PRESENCE \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xCC03)
+
 #define DRIVER_OPTION_CCID_EXCHANGE_AUTHORIZED 1
 #define DRIVER_OPTION_GEMPC_TWIN_KEY_APDU 2
 #define DRIVER_OPTION_USE_BOGUS_FIRMWARE 4
+#define DRIVER_OPTION_ADAPTIVE_TIMEOUT 8
 #define DRIVER_OPTION_DISABLE_PIN_RETRIES (1 << 6)
+#define DRIVER_OPTION_SHM_COUNTERS (1 << 7)
 
 extern int DriverOptions;
 
@@ -29,6 +29,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <ifdhandler.h>
 
 #include <config.h>
@@ -40,6 +44,7 @@
 #include "commands.h"
 #include "parser.h"
 #include "strlcpycat.h"
+#include "counters.h"
 
 #define SYNC 0x03
 #define CTRL_ACK 0x06
@@ -93,6 +98,41 @@
  */
 #define GEMPCTWIN_MAXBUF (271 +2 +1) * 2
 
+/* offsets in a CCID frame */
+#define BSLOT_OFFSET 5
+#define BSEQ_OFFSET 6
+
+struct multiSlot_ConcurrentAccess
+{
+	unsigned char buffer[GEMPCTWIN_MAXBUF];
+	int length;
+	status_t status;
+	bool ready;
+
+	/* the card sent a time request: restart the read timeout */
+	bool time_request;
+
+	/* reader_index of the slot (or -1 if the slot is not opened) */
+	int reader_index;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+};
+
+struct serialDevice_MultiSlot_Extension
+{
+	int reader_index;
+
+	_Atomic bool terminated;
+
+	/* slot of the last command sent. Used to route NAK frames */
+	int last_slot;
+	pthread_mutex_t write_mutex;
+
+	pthread_t thread_concurrent;
+	struct multiSlot_ConcurrentAccess *concurrent;
+};
+
 typedef struct
 {
 	/*
@@ -136,6 +176,11 @@ typedef struct
 	 */
 	_ccid_descriptor ccid;
 
+	/*
+	 * pointer to the multislot extension (if any)
+	 */
+	struct serialDevice_MultiSlot_Extension *multislot_extension;
+
 } _serialDevice;
 
 /* The _serialDevice structure must be defined before including ccid_serial.h */
@@ -163,6 +208,21 @@ static int ReadChunk(unsigned int reader_index, unsigned char *buffer,
 static int get_bytes(unsigned int reader_index, /*@out@*/ unsigned char *buffer,
 	int length);
 
+static status_t WriteFrame(unsigned int reader_index, unsigned int length,
+	unsigned char *buffer);
+
+static status_t ReadFrame(unsigned int reader_index, unsigned int *length,
+	unsigned char *buffer, bool echo, bool return_on_event);
+
+static void SlotChange(unsigned int reader_index, unsigned char state);
+
+/* Specific hooks for multislot readers */
+static status_t Multi_ReadSerial(unsigned int reader_index,
+	unsigned int *length, unsigned char *buffer, int bSeq);
+static struct serialDevice_MultiSlot_Extension *Multi_CreateFirstSlot(unsigned int reader_index);
+static void Multi_Terminate(unsigned int reader_index);
+static void Multi_HandOver(unsigned int reader_index);
+
 
 /*****************************************************************************
  *
@@ -171,10 +231,62 @@ static int get_bytes(unsigned int reader_index, /*@out@*/ unsigned char *buffer,
  *****************************************************************************/
 status_t WriteSerial(unsigned int reader_index, unsigned int length,
 	unsigned char *buffer)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	struct multiSlot_ConcurrentAccess *concurrent;
+	int slot;
+	status_t ret;
+	uint64_t start = get_time_us();
+
+	msExt = serialDevice[reader_index].multislot_extension;
+	if (NULL == msExt)
+	{
+		ret = WriteFrame(reader_index, length, buffer);
+		goto end;
+	}
+
+	/* forget any answer not claimed by a previous command */
+	slot = serialDevice[reader_index].ccid.bCurrentSlotIndex;
+	concurrent = msExt->concurrent;
+	pthread_mutex_lock(&concurrent[slot].mutex);
+	concurrent[slot].ready = false;
+	pthread_mutex_unlock(&concurrent[slot].mutex);
+
+	/* the serial line is shared by all the slots */
+	pthread_mutex_lock(&msExt->write_mutex);
+	msExt->last_slot = slot;
+	ret = WriteFrame(reader_index, length, buffer);
+	pthread_mutex_unlock(&msExt->write_mutex);
+
+end:
+	Counters[reader_index].transport_time_us += get_time_us() - start;
+	if (STATUS_SUCCESS == ret)
+	{
+		Counters[reader_index].messages_out++;
+		Counters[reader_index].bytes_out += length;
+	}
+
+	return ret;
+} /* WriteSerial */
+
+
+/*****************************************************************************
+ *
+ *				WriteFrame: Send a CCID frame on the serial line
+ *
+ *****************************************************************************/
+static status_t WriteFrame(unsigned int reader_index, unsigned int length,
+	unsigned char *buffer)
 {
 	unsigned int i;
 	unsigned char lrc;
-	unsigned char low_level_buffer[GEMPCTWIN_MAXBUF];
+	unsigned char header[2];
+	struct iovec iov[3];
+	struct iovec *piov;
+	int iovcnt;
+	ssize_t written;
+	size_t to_write;
+	int fd = serialDevice[reader_index].fd;
 
 	char debug_header[] = "-> 123456 ";
 
@@ -189,29 +301,97 @@ status_t WriteSerial(unsigned int reader_index, unsigned int length,
 	}
 
 	/* header */
-	low_level_buffer[0] = 0x03;	/* SYNC */
-	low_level_buffer[1] = 0x06;	/* ACK */
+	header[0] = SYNC;
+	header[1] = CTRL_ACK;
+
+	/* checksum, computed directly on the caller buffer */
+	lrc = SYNC ^ CTRL_ACK;
+	for (i=0; i<length; i++)
+		lrc ^= buffer[i];
 
-	/* CCID command */
-	memcpy(low_level_buffer+2, buffer, length);
+	/* log the complete frame (SYNC, CTRL and LRC included) to diagnose
+	 * the serial framing. The copy is only done for the log */
+	if (LogLevel & DEBUG_LEVEL_COMM)
+	{
+		unsigned char frame[GEMPCTWIN_MAXBUF];
 
-	/* checksum */
-	lrc = 0;
-	for(i=0; i<length+2; i++)
-		lrc ^= low_level_buffer[i];
-	low_level_buffer[length+2] = lrc;
+		memcpy(frame, header, sizeof(header));
+		memcpy(frame + sizeof(header), buffer, length);
+		frame[sizeof(header) + length] = lrc;
+		DEBUG_XXD(debug_header, frame, length+3);
+	}
 
-	DEBUG_XXD(debug_header, low_level_buffer, length+3);
+	/* header + CCID command + checksum without an intermediate copy */
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = length;
+	iov[2].iov_base = &lrc;
+	iov[2].iov_len = 1;
 
-	if (write(serialDevice[reader_index].fd, low_level_buffer,
-		length+3) != length+3)
+	piov = iov;
+	iovcnt = 3;
+	to_write = length+3;
+
+	while (to_write > 0)
 	{
-		DEBUG_CRITICAL2("write error: %s", strerror(errno));
-		return STATUS_UNSUCCESSFUL;
+		written = writev(fd, piov, iovcnt);
+		if (written < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				/* wait until the port can accept more data */
+# ifndef S_SPLINT_S
+				fd_set fdset;
+# endif
+				struct timeval t;
+				int rv;
+
+				FD_ZERO(&fdset);
+				FD_SET(fd, &fdset);
+				t.tv_sec = serialDevice[reader_index].ccid.readTimeout / 1000;
+				t.tv_usec = (serialDevice[reader_index].ccid.readTimeout - t.tv_sec*1000)*1000;
+
+				rv = select(fd+1, NULL, &fdset, NULL, &t);
+				if (rv > 0 || (rv < 0 && EINTR == errno))
+					continue;
+
+				if (0 == rv)
+				{
+					DEBUG_CRITICAL2("write timeout (%d ms)",
+						serialDevice[reader_index].ccid.readTimeout);
+					Counters[reader_index].timeouts++;
+				}
+				else
+					DEBUG_CRITICAL2("select: %s", strerror(errno));
+				return STATUS_UNSUCCESSFUL;
+			}
+
+			DEBUG_CRITICAL2("write error: %s", strerror(errno));
+			return STATUS_UNSUCCESSFUL;
+		}
+
+		to_write -= written;
+
+		/* partial write: skip the iovecs already sent */
+		while (iovcnt > 0 && (size_t)written >= piov->iov_len)
+		{
+			written -= piov->iov_len;
+			piov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			piov->iov_base = (unsigned char *)piov->iov_base + written;
+			piov->iov_len -= written;
+		}
 	}
 
 	return STATUS_SUCCESS;
-} /* WriteSerial */
+} /* WriteFrame */
 
 
 /*****************************************************************************
@@ -221,19 +401,46 @@ status_t WriteSerial(unsigned int reader_index, unsigned int length,
  *****************************************************************************/
 status_t ReadSerial(unsigned int reader_index,
 	unsigned int *length, unsigned char *buffer, int bSeq)
+{
+	uint64_t start = get_time_us();
+	status_t ret;
+
+	/* multi slot reader: the frame is received by Multi_ReadProc() */
+	if (serialDevice[reader_index].multislot_extension)
+		ret = Multi_ReadSerial(reader_index, length, buffer, bSeq);
+	else
+		/* ignore bSeq */
+		ret = ReadFrame(reader_index, length, buffer,
+			serialDevice[reader_index].echo, false);
+
+	Counters[reader_index].transport_time_us += get_time_us() - start;
+	if (STATUS_SUCCESS == ret)
+	{
+		Counters[reader_index].messages_in++;
+		Counters[reader_index].bytes_in += *length;
+	}
+
+	return ret;
+} /* ReadSerial */
+
+
+/*****************************************************************************
+ *
+ *				ReadFrame: Receive a frame from the serial line
+ *
+ *				If return_on_event is set a card movement is returned as
+ *				a frame of 0 byte and a T=0 time request as a frame of 1
+ *				byte.
+ *
+ *****************************************************************************/
+static status_t ReadFrame(unsigned int reader_index, unsigned int *length,
+	unsigned char *buffer, bool echo, bool return_on_event)
 {
 	unsigned char c;
 	int rv;
-	int echo;
 	int to_read;
 	int i;
 
-	/* ignore bSeq */
-	(void)bSeq;
-
-	/* we get the echo first */
-	echo = serialDevice[reader_index].echo;
-
 start:
 	DEBUG_COMM("start");
 	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
@@ -248,6 +455,13 @@ start:
 	if (c >= 0x80)
 	{
 		DEBUG_COMM2("time request: 0x%02X", c);
+		Counters[reader_index].time_extensions++;
+		if (return_on_event)
+		{
+			buffer[0] = c;
+			*length = 1;
+			return STATUS_SUCCESS;
+		}
 		goto start;
 	}
 
@@ -272,8 +486,15 @@ slot_change:
 		{
 			DEBUG_COMM2("Unknown card movement: %d", c);
 		}
+	SlotChange(reader_index, c);
+	if (return_on_event)
+		goto event;
 	goto start;
 
+event:
+	*length = 0;
+	return STATUS_SUCCESS;
+
 sync:
 	DEBUG_COMM("sync");
 	if ((rv = get_bytes(reader_index, &c, 1)) != STATUS_SUCCESS)
@@ -347,7 +568,7 @@ ack:
 	*length = to_read;
 
 	return STATUS_SUCCESS;
-} /* ReadSerial */
+} /* ReadFrame */
 
 
 /*****************************************************************************
@@ -447,6 +668,7 @@ static int ReadChunk(unsigned int reader_index, unsigned char *buffer,
 			if (i == 0)
 			{
 				DEBUG_COMM2("Timeout! (%d ms)", serialDevice[reader_index].ccid.readTimeout);
+				Counters[reader_index].timeouts++;
 				return -1;
 			}
 
@@ -564,6 +786,18 @@ static status_t set_ccid_descriptor(unsigned int reader_index,
 			serialDevice[reader_index].ccid.dwSlotStatus = IFD_ICC_PRESENT;
 			DEBUG_INFO2("Opening slot: %d",
 					serialDevice[reader_index].ccid.bCurrentSlotIndex);
+
+			/* route the frames of this slot to the new reader_index */
+			if (serialDevice[reader_index].multislot_extension)
+			{
+				struct multiSlot_ConcurrentAccess *concurrent;
+				int slot = serialDevice[reader_index].ccid.bCurrentSlotIndex;
+
+				concurrent = serialDevice[reader_index].multislot_extension->concurrent;
+				pthread_mutex_lock(&concurrent[slot].mutex);
+				concurrent[slot].reader_index = reader_index;
+				pthread_mutex_unlock(&concurrent[slot].mutex);
+			}
 			switch (readerID)
 			{
 				case GEMCOREPOSPRO:
@@ -626,14 +860,18 @@ static status_t set_ccid_descriptor(unsigned int reader_index,
 	serialDevice[reader_index].ccid.bMaxCCIDBusySlots = 1;
 	serialDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialTwinDataRates;
 	serialDevice[reader_index].ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT;
+	serialDevice[reader_index].ccid.xfrLatencySamples = 0;
+	serialDevice[reader_index].ccid.bAbortFailed = false;
 	serialDevice[reader_index].ccid.dwSlotStatus = IFD_ICC_PRESENT;
 	serialDevice[reader_index].ccid.bVoltageSupport = 0x07;	/* 1.8V, 3V and 5V */
+	serialDevice[reader_index].ccid.learnedVoltage = -1;
 	serialDevice[reader_index].ccid.gemalto_firmware_features = NULL;
 	serialDevice[reader_index].ccid.dwProtocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
 #ifdef ENABLE_ZLP
 	serialDevice[reader_index].ccid.zlp = false;
 #endif
 	serialDevice[reader_index].echo = true;
+	serialDevice[reader_index].multislot_extension = NULL;
 
 	/* change some values depending on the reader */
 	switch (readerID)
@@ -703,6 +941,7 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	char reader_name[255] = "GemPCTwin";
 	char *p;
 	status_t ret;
+	bool speed_changed = false;
 
 	DEBUG_COMM3("Reader index: %X, Device: %s", reader_index, dev_name);
 
@@ -828,8 +1067,9 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 			if (IFD_SUCCESS == CmdEscape(reader_index, tx_buffer,
 				sizeof(tx_buffer), rx_buffer, &rx_length, 0))
 			{
-				/* Let the reader setup its new communication speed */
-				(void)usleep(250*1000);
+				/* the reader is ready when it answers at the new
+				 * speed, see below */
+				speed_changed = true;
 			}
 			else
 			{
@@ -853,6 +1093,22 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 		return STATUS_UNSUCCESSFUL;
 	}
 
+	/* Let the reader setup its new communication speed
+	 * Wait until it answers instead of a fixed 250 ms delay */
+	if (speed_changed)
+	{
+		unsigned char pcbuffer[SIZE_GET_SLOT_STATUS];
+		unsigned int old_timeout;
+		int i;
+
+		old_timeout = serialDevice[reader_index].ccid.readTimeout;
+		serialDevice[reader_index].ccid.readTimeout = 50;
+		for (i=0; i<10; i++)
+			if (IFD_SUCCESS == CmdGetSlotStatus(reader_index, pcbuffer))
+				break;
+		serialDevice[reader_index].ccid.readTimeout = old_timeout;
+	}
+
 	/* perform a command to be sure a Gemalto reader is connected
 	 * get the reader firmware */
 	{
@@ -900,6 +1156,12 @@ status_t OpenSerialByName(unsigned int reader_index, char *dev_name)
 	serialDevice[reader_index].ccid.sIFD_iManufacturer = NULL;
 	serialDevice[reader_index].ccid.IFD_bcdDevice = 0;
 
+	/* multi slot reader: receive the frames in a dedicated thread so
+	 * that each slot gets its own answers and card movements */
+	if ((serialDevice[reader_index].ccid.bMaxSlotIndex > 0)
+		&& !serialDevice[reader_index].echo)
+		serialDevice[reader_index].multislot_extension = Multi_CreateFirstSlot(reader_index);
+
 	return STATUS_SUCCESS;
 } /* OpenSerialByName */
 
@@ -919,14 +1181,37 @@ status_t CloseSerial(unsigned int reader_index)
 
 	DEBUG_COMM2("Closing serial device: %s", serialDevice[reader_index].device);
 
+	/* the frames and card movements of this slot are no more for this
+	 * reader_index, it may be reused by another reader */
+	if (serialDevice[reader_index].multislot_extension)
+	{
+		struct multiSlot_ConcurrentAccess *concurrent;
+		int slot = serialDevice[reader_index].ccid.bCurrentSlotIndex;
+
+		concurrent = serialDevice[reader_index].multislot_extension->concurrent;
+		pthread_mutex_lock(&concurrent[slot].mutex);
+		concurrent[slot].reader_index = -1;
+		pthread_mutex_unlock(&concurrent[slot].mutex);
+	}
+
 	/* Decrement number of opened slot */
 	(*serialDevice[reader_index].nb_opened_slots)--;
 
+	/* the reading thread uses this reader_index */
+	if (*serialDevice[reader_index].nb_opened_slots
+		&& serialDevice[reader_index].multislot_extension
+		&& ((int)reader_index == serialDevice[reader_index].multislot_extension->reader_index))
+		Multi_HandOver(reader_index);
+
 	/* release the allocated resources for the last slot only */
 	if (0 == *serialDevice[reader_index].nb_opened_slots)
 	{
 		DEBUG_COMM("Last slot closed. Release resources");
 
+		/* If this is a multislot reader, stop the reading thread */
+		if (serialDevice[reader_index].multislot_extension)
+			Multi_Terminate(reader_index);
+
 		(void)close(serialDevice[reader].fd);
 		serialDevice[reader].fd = -1;
 
@@ -964,3 +1249,439 @@ _ccid_descriptor *get_ccid_descriptor(unsigned int reader_index)
 } /* get_ccid_descriptor */
 
 
+
+
+/*****************************************************************************
+ *
+ *					SlotChange: decode a NotifySlotChange
+ *
+ *	bmSlotIccState uses 2 bits per slot:
+ *	bit 2n: card present in slot n
+ *	bit 2n+1: slot n changed
+ *
+ ****************************************************************************/
+static void SlotChange(unsigned int reader_index, unsigned char state)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	int slot;
+
+	msExt = serialDevice[reader_index].multislot_extension;
+
+	/* only 4 slots fit in the bmSlotIccState byte */
+	for (slot=0; slot<=serialDevice[reader_index].ccid.bMaxSlotIndex && slot<4;
+		slot++)
+	{
+		int index;
+		bool present;
+
+		/* no change for this slot */
+		if (! (state & (0x02 << (slot*2))))
+			continue;
+
+		present = state & (0x01 << (slot*2));
+
+		if (msExt)
+		{
+			pthread_mutex_lock(&msExt->concurrent[slot].mutex);
+			index = msExt->concurrent[slot].reader_index;
+			pthread_mutex_unlock(&msExt->concurrent[slot].mutex);
+		}
+		else
+			index = (0 == slot) ? (int)reader_index : -1;
+
+		DEBUG_COMM3("Slot %d: card %s", slot, present ? "present" : "absent");
+
+		/* slot not (yet) opened */
+		if (index < 0)
+			continue;
+
+		serialDevice[index].ccid.dwSlotStatus =
+			present ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT;
+	}
+} /* SlotChange */
+
+
+/*****************************************************************************
+ *
+ *					Multi_ReadSerial
+ *
+ ****************************************************************************/
+static status_t Multi_ReadSerial(unsigned int reader_index,
+	unsigned int *length, unsigned char *buffer, int bSeq)
+{
+	struct multiSlot_ConcurrentAccess *concurrent;
+	int slot = serialDevice[reader_index].ccid.bCurrentSlotIndex;
+	char debug_header[] = "<- 123456 ";
+	int duplicate_frame = 0;
+	status_t ret;
+	int rv = 0;
+
+	(void)snprintf(debug_header, sizeof(debug_header), "<- %06X ",
+		reader_index);
+
+	concurrent = serialDevice[reader_index].multislot_extension->concurrent;
+
+	pthread_mutex_lock(&concurrent[slot].mutex);
+
+read_again:
+	/* a frame is available? */
+	if (! concurrent[slot].ready)
+	{
+		struct timespec timeout;
+		time_t timeout_sec;
+		long timeout_msec;
+
+time_request:
+		timeout_sec = serialDevice[reader_index].ccid.readTimeout / 1000;
+		timeout_msec = serialDevice[reader_index].ccid.readTimeout - timeout_sec * 1000;
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += timeout_sec;
+		timeout.tv_nsec += timeout_msec * 1000 * 1000;
+		if (timeout.tv_nsec >= 1000 * 1000 * 1000)
+		{
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000 * 1000 * 1000;
+		}
+
+		/* wait for a new frame */
+		DEBUG_COMM2("Waiting data for slot %d", slot);
+		do
+			rv = pthread_cond_timedwait(&concurrent[slot].condition,
+				&concurrent[slot].mutex, &timeout);
+		while (!rv && !concurrent[slot].ready
+			&& !concurrent[slot].time_request);
+
+		/* the card is alive: wait again as ReadFrame() does */
+		if (!rv && !concurrent[slot].ready)
+		{
+			concurrent[slot].time_request = false;
+			DEBUG_COMM2("Time request for slot %d", slot);
+			goto time_request;
+		}
+	}
+	concurrent[slot].time_request = false;
+
+	if (rv)
+	{
+		*length = 0;
+		DEBUG_COMM3("Timeout! (%d ms) for slot %d",
+			serialDevice[reader_index].ccid.readTimeout, slot);
+		Counters[reader_index].timeouts++;
+		ret = STATUS_COMM_ERROR;
+		goto end;
+	}
+
+	concurrent[slot].ready = false;
+	ret = concurrent[slot].status;
+	if (ret != STATUS_SUCCESS)
+		goto end;
+
+	if (concurrent[slot].length > (int)*length)
+	{
+		DEBUG_CRITICAL3("Received %d bytes but expected only %d",
+			concurrent[slot].length, *length);
+		ret = STATUS_COMM_ERROR;
+		goto end;
+	}
+
+	/* answer to a previous command that timed out */
+	if ((bSeq != -1) && (concurrent[slot].buffer[BSEQ_OFFSET] != bSeq))
+	{
+		duplicate_frame++;
+		if (duplicate_frame > 10)
+		{
+			DEBUG_CRITICAL("Too many duplicate frame detected");
+			ret = STATUS_UNSUCCESSFUL;
+			goto end;
+		}
+		DEBUG_INFO1("Invalid frame detected");
+		Counters[reader_index].duplicate_frames++;
+		goto read_again;
+	}
+
+	*length = concurrent[slot].length;
+	memcpy(buffer, concurrent[slot].buffer, *length);
+	DEBUG_XXD(debug_header, buffer, *length);
+
+end:
+	pthread_mutex_unlock(&concurrent[slot].mutex);
+
+	return ret;
+} /* Multi_ReadSerial */
+
+
+/*****************************************************************************
+ *
+ *					Multi_ReadProc
+ *
+ ****************************************************************************/
+static void *Multi_ReadProc(void *p_ext)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	struct multiSlot_ConcurrentAccess *concurrent;
+	int reader_index;
+	int fd;
+	unsigned char buffer[GEMPCTWIN_MAXBUF];
+
+	msExt = p_ext;
+	concurrent = msExt->concurrent;
+	reader_index = msExt->reader_index;
+	fd = serialDevice[reader_index].fd;
+
+	DEBUG_COMM2("Multi_ReadProc (%d): thread starting", reader_index);
+
+	while (! msExt->terminated)
+	{
+		unsigned int length;
+		status_t ret;
+		int slot;
+
+		/* nothing buffered: wait for the reader to send something */
+		if (serialDevice[reader_index].buffer_offset
+			>= serialDevice[reader_index].buffer_offset_last)
+		{
+# ifndef S_SPLINT_S
+			fd_set fdset;
+# endif
+			struct timeval t;
+			int rv;
+
+			FD_ZERO(&fdset);
+			FD_SET(fd, &fdset);
+			/* check msExt->terminated every second */
+			t.tv_sec = 1;
+			t.tv_usec = 0;
+
+			rv = select(fd+1, &fdset, NULL, NULL, &t);
+			if (0 == rv)
+				continue;
+
+			if (rv < 0)
+			{
+				if (errno != EINTR)
+				{
+					DEBUG_CRITICAL2("select: %s", strerror(errno));
+
+					/* wait a bit to avoid a fast error loop */
+					(void)usleep(100*1000);
+				}
+				continue;
+			}
+		}
+
+		length = sizeof buffer;
+		ret = ReadFrame(reader_index, &length, buffer, false, true);
+
+		/* card movement */
+		if ((STATUS_SUCCESS == ret) && (0 == length))
+			continue;
+
+		/* time request for the command in progress */
+		if ((STATUS_SUCCESS == ret) && (1 == length))
+		{
+			pthread_mutex_lock(&msExt->write_mutex);
+			slot = msExt->last_slot;
+			pthread_mutex_unlock(&msExt->write_mutex);
+
+			pthread_mutex_lock(&concurrent[slot].mutex);
+			concurrent[slot].time_request = true;
+			pthread_cond_signal(&concurrent[slot].condition);
+			pthread_mutex_unlock(&concurrent[slot].mutex);
+			continue;
+		}
+
+		if (STATUS_SUCCESS == ret)
+		{
+			slot = buffer[BSLOT_OFFSET];
+			if (slot > serialDevice[reader_index].ccid.bMaxSlotIndex)
+			{
+				DEBUG_CRITICAL2("Frame for invalid slot %d", slot);
+				continue;
+			}
+		}
+		else
+		{
+			/* NAK and errors are for the slot of the last command */
+			pthread_mutex_lock(&msExt->write_mutex);
+			slot = msExt->last_slot;
+			pthread_mutex_unlock(&msExt->write_mutex);
+		}
+
+		DEBUG_COMM3("Read %d bytes for slot %d", length, slot);
+
+		/* copy and signal */
+		pthread_mutex_lock(&concurrent[slot].mutex);
+
+		if (STATUS_SUCCESS == ret)
+		{
+			memcpy(concurrent[slot].buffer, buffer, length);
+			concurrent[slot].length = length;
+		}
+		else
+			concurrent[slot].length = 0;
+		concurrent[slot].status = ret;
+		concurrent[slot].ready = true;
+		pthread_cond_signal(&concurrent[slot].condition);
+
+		pthread_mutex_unlock(&concurrent[slot].mutex);
+	}
+
+	DEBUG_COMM2("Multi_ReadProc (%d): Thread terminated", reader_index);
+
+	pthread_exit(NULL);
+	return NULL;
+} /* Multi_ReadProc */
+
+
+/*****************************************************************************
+ *
+ *					Multi_CreateFirstSlot
+ *
+ ****************************************************************************/
+static struct serialDevice_MultiSlot_Extension *Multi_CreateFirstSlot(unsigned int reader_index)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	struct multiSlot_ConcurrentAccess *concurrent;
+	int nb_slots = serialDevice[reader_index].ccid.bMaxSlotIndex +1;
+
+	/* Allocate a new extension buffer */
+	msExt = malloc(sizeof(struct serialDevice_MultiSlot_Extension));
+	if (NULL == msExt)
+		return NULL;
+
+	/* Remember the index */
+	msExt->reader_index = reader_index;
+
+	atomic_init(&msExt->terminated, false);
+	msExt->last_slot = 0;
+	pthread_mutex_init(&msExt->write_mutex, NULL);
+
+	/* concurrent serial read */
+	concurrent = calloc(nb_slots, sizeof(struct multiSlot_ConcurrentAccess));
+	if (NULL == concurrent)
+	{
+		DEBUG_CRITICAL("malloc failed");
+		pthread_mutex_destroy(&msExt->write_mutex);
+		free(msExt);
+		return NULL;
+	}
+	for (int slot=0; slot<nb_slots; slot++)
+	{
+		/* Create mutex and condition object for the concurrent read */
+		pthread_mutex_init(&concurrent[slot].mutex, NULL);
+		pthread_cond_init(&concurrent[slot].condition, NULL);
+		concurrent[slot].reader_index = -1;
+	}
+	concurrent[0].reader_index = reader_index;
+	msExt->concurrent = concurrent;
+
+	/* the buffered bytes now belong to the reading thread */
+	if (pthread_create(&msExt->thread_concurrent, NULL, Multi_ReadProc, msExt))
+	{
+		DEBUG_CRITICAL("pthread_create failed");
+		for (int slot=0; slot<nb_slots; slot++)
+		{
+			pthread_cond_destroy(&concurrent[slot].condition);
+			pthread_mutex_destroy(&concurrent[slot].mutex);
+		}
+		free(concurrent);
+		pthread_mutex_destroy(&msExt->write_mutex);
+		free(msExt);
+		return NULL;
+	}
+
+	return msExt;
+} /* Multi_CreateFirstSlot */
+
+
+/*****************************************************************************
+ *
+ *					Multi_Terminate
+ *
+ ****************************************************************************/
+static void Multi_Terminate(unsigned int reader_index)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	struct multiSlot_ConcurrentAccess *concurrent;
+
+	msExt = serialDevice[reader_index].multislot_extension;
+
+	/* stop the reading thread */
+	msExt->terminated = true;
+	pthread_join(msExt->thread_concurrent, NULL);
+
+	concurrent = msExt->concurrent;
+	for (int slot=0; slot<=serialDevice[reader_index].ccid.bMaxSlotIndex;
+		slot++)
+	{
+		pthread_cond_destroy(&concurrent[slot].condition);
+		pthread_mutex_destroy(&concurrent[slot].mutex);
+	}
+	free(concurrent);
+
+	pthread_mutex_destroy(&msExt->write_mutex);
+
+	/* Deallocate the extension itself */
+	free(msExt);
+
+	serialDevice[reader_index].multislot_extension = NULL;
+} /* Multi_Terminate */
+
+
+/*****************************************************************************
+ *
+ *					Multi_HandOver
+ *
+ *	The slot used by the reading thread is closed but not the other
+ *	slots. Restart the thread with the reader_index of an opened slot.
+ *
+ ****************************************************************************/
+static void Multi_HandOver(unsigned int reader_index)
+{
+	struct serialDevice_MultiSlot_Extension *msExt;
+	struct multiSlot_ConcurrentAccess *concurrent;
+	int new_index = -1;
+
+	msExt = serialDevice[reader_index].multislot_extension;
+	concurrent = msExt->concurrent;
+
+	for (int slot=0; slot<=serialDevice[reader_index].ccid.bMaxSlotIndex;
+		slot++)
+	{
+		pthread_mutex_lock(&concurrent[slot].mutex);
+		if (concurrent[slot].reader_index >= 0)
+			new_index = concurrent[slot].reader_index;
+		pthread_mutex_unlock(&concurrent[slot].mutex);
+
+		if (new_index >= 0)
+			break;
+	}
+
+	/* should not happen */
+	if (new_index < 0)
+	{
+		DEBUG_CRITICAL("No opened slot found");
+		return;
+	}
+
+	DEBUG_COMM3("Reading thread moved from reader %d to %d", reader_index,
+		new_index);
+
+	/* stop the reading thread */
+	msExt->terminated = true;
+	pthread_join(msExt->thread_concurrent, NULL);
+
+	/* the bytes already read from the serial line */
+	memcpy(serialDevice[new_index].buffer, serialDevice[reader_index].buffer,
+		sizeof(serialDevice[new_index].buffer));
+	serialDevice[new_index].buffer_offset =
+		serialDevice[reader_index].buffer_offset;
+	serialDevice[new_index].buffer_offset_last =
+		serialDevice[reader_index].buffer_offset_last;
+
+	msExt->reader_index = new_index;
+	msExt->terminated = false;
+	if (pthread_create(&msExt->thread_concurrent, NULL, Multi_ReadProc, msExt))
+		DEBUG_CRITICAL("pthread_create failed");
+} /* Multi_HandOver */
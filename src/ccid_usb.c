@@ -41,6 +41,7 @@
 #include "parser.h"
 #include "ccid_ifdhandler.h"
 #include "sys_generic.h"
+#include "counters.h"
 
 
 /* write timeout
@@ -64,10 +65,18 @@ libusb_context *ctx = NULL;
 
 #define CCID_INTERRUPT_SIZE 8
 
-struct multiSlot_ConcurrentAccess
+/* frame read by Multi_ReadProc() */
+struct multiSlot_Frame
 {
-	unsigned char buffer[10 + MAX_BUFFER_SIZE_EXTENDED];
+	struct multiSlot_Frame *next;	/* in the pool of free frames */
 	int length;
+	unsigned char buffer[];
+};
+
+struct multiSlot_ConcurrentAccess
+{
+	/* frame received for the slot and not yet read (or NULL) */
+	struct multiSlot_Frame *frame;
 
 	pthread_mutex_t mutex;
 	pthread_cond_t condition;
@@ -88,6 +97,13 @@ struct usbDevice_MultiSlot_Extension
 	pthread_t thread_concurrent;
 	struct multiSlot_ConcurrentAccess *concurrent;
 	libusb_device_handle *dev_handle;
+
+	/* Free frames shared by all the slots. The frames are allocated
+	 * when needed so only the frames in use take memory: the one read
+	 * by Multi_ReadProc() and the ones not yet read by a slot */
+	pthread_mutex_t pool_mutex;
+	struct multiSlot_Frame *pool;
+	int frame_size;
 };
 
 typedef struct
@@ -119,6 +135,9 @@ typedef struct
 	/* pointer to the multislot extension (if any) */
 	struct usbDevice_MultiSlot_Extension *multislot_extension;
 
+	/* entry used in DataRatesCache[] (or -1) */
+	int data_rates_cache;
+
 	bool disconnected;
 } _usbDevice;
 
@@ -127,20 +146,67 @@ typedef struct
 
 /* Specific hooks for multislot readers */
 static int Multi_InterruptRead(int reader_index, int timeout /* in ms */);
+static status_t ReadUSBFrame(unsigned int reader_index, unsigned int *length,
+	unsigned char *buffer, int bSeq);
 static void Multi_InterruptStop(int reader_index);
 static struct usbDevice_MultiSlot_Extension *Multi_CreateFirstSlot(int reader_index);
 static struct usbDevice_MultiSlot_Extension *Multi_CreateNextSlot(int physical_reader_index);
 static void Multi_PollingTerminate(struct usbDevice_MultiSlot_Extension *msExt);
+static struct multiSlot_Frame *Multi_GetFrame(struct usbDevice_MultiSlot_Extension *msExt);
+static void Multi_PutFrame(struct usbDevice_MultiSlot_Extension *msExt,
+	struct multiSlot_Frame *frame);
 
 static int get_end_points(struct libusb_config_descriptor *desc,
 	_usbDevice *usbdevice, int num);
 bool ccid_check_firmware(struct libusb_device_descriptor *desc);
-static unsigned int *get_data_rates(unsigned int reader_index,
+static unsigned int *get_data_rates(libusb_device_handle *dev_handle,
+	struct libusb_config_descriptor *desc, int num, bool *transient);
+static unsigned int *get_cached_data_rates(unsigned int reader_index,
 	struct libusb_config_descriptor *desc, int num);
 
 /* ne need to initialize to 0 since it is static */
 static _usbDevice usbDevice[CCID_DRIVER_MAX_READERS];
 
+/*
+ * Data rates (GET_DATA_RATES) per model, firmware and interface, so the
+ * request is sent only once. An entry is used by refcount opened
+ * devices and is kept for a next open. An opened device uses at most
+ * one entry so a free entry (refcount 0) is always available.
+ */
+#define DATA_RATES_CACHE_SIZE CCID_DRIVER_MAX_READERS
+static struct
+{
+	int readerID;	/* 0 for an unused entry */
+	int bcdDevice;
+	int interface;
+	unsigned int *rates;	/* NULL if not supported by the reader */
+	int refcount;
+} DataRatesCache[DATA_RATES_CACHE_SIZE];
+
+#ifdef USE_COMPOSITE_AS_MULTISLOT
+/* maximum number of CCID interfaces of a composite reader */
+#define COMPOSITE_MAX_INTERFACES 4
+
+/* GET_DATA_RATES sent to another CCID interface of a composite reader
+ * while its first interface is opened */
+struct data_rates_prefetch
+{
+	libusb_device_handle *dev_handle;
+	struct libusb_config_descriptor *desc;
+	int num;	/* index of the interface in desc */
+	int interface;	/* bInterfaceNumber */
+	unsigned int *rates;
+	bool transient;
+	pthread_t thread;
+};
+
+static int data_rates_prefetch_start(libusb_device_handle *dev_handle,
+	struct libusb_config_descriptor *desc, int num, int readerID,
+	int bcdDevice, struct data_rates_prefetch prefetch[]);
+static void data_rates_prefetch_end(struct data_rates_prefetch prefetch[],
+	int nb, int readerID, int bcdDevice);
+#endif
+
 #define PCSCLITE_MANUKEY_NAME "ifdVendorID"
 #define PCSCLITE_PRODKEY_NAME "ifdProductID"
 #define PCSCLITE_NAMEKEY_NAME "ifdFriendlyName"
@@ -178,9 +244,240 @@ static struct _bogus_firmware Bogus_firmwares[] = {
 #endif
 };
 
+/* Info.plist parsed by the first OpenUSBByName() and kept until the
+ * last reader is closed. The next slots or interfaces of a reader do not
+ * parse it again.
+ * OpenUSBByName() holds PlistMutex while it uses the lists of plist.
+ * close_libusb_if_needed() takes it to release plist and the libusb
+ * context, possibly from another pcscd thread. It also protects
+ * DataRatesCache[]. */
+static list_t plist;
+static bool plist_loaded = false;
+static pthread_mutex_t PlistMutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* data rates supported by the secondary slots on the GemCore Pos Pro & SIM Pro */
 unsigned int SerialCustomDataRates[] = { GEMPLUS_CUSTOM_DATA_RATES, 0 };
 
+/* libusb hotplug support (libusb >= 1.0.16)
+ * Not used on macOS since the device is given by its friendly name */
+#if defined(LIBUSB_HOTPLUG_MATCH_ANY) && !defined(__APPLE__)
+#define USE_DEVICE_INDEX
+#endif
+
+#ifdef USE_DEVICE_INDEX
+/*
+ * Supported devices currently attached, kept up to date by a libusb
+ * hotplug callback so that opening a reader does not enumerate the bus
+ */
+#define DEVICE_INDEX_SIZE (2*CCID_DRIVER_MAX_READERS)
+static libusb_device *DeviceIndex[DEVICE_INDEX_SIZE];
+/* sorted list of VendorID << 16 + ProductID from Info.plist */
+static unsigned int *DeviceIndexIDs;
+static size_t DeviceIndexIDsSize;
+static bool DeviceIndexActive = false;
+static libusb_hotplug_callback_handle DeviceIndexHandle;
+static pthread_mutex_t DeviceIndexMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*****************************************************************************
+ *
+ *					compare_id
+ *
+ ****************************************************************************/
+static int compare_id(const void *a, const void *b)
+{
+	unsigned int id_a = *(const unsigned int *)a;
+	unsigned int id_b = *(const unsigned int *)b;
+
+	return (id_a > id_b) - (id_a < id_b);
+} /* compare_id */
+
+/*****************************************************************************
+ *
+ *					device_index_cb
+ *
+ ****************************************************************************/
+static int device_index_cb(libusb_context *context, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	unsigned int id;
+	int i;
+
+	(void)context;
+	(void)user_data;
+
+	pthread_mutex_lock(&DeviceIndexMutex);
+
+	if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event)
+	{
+		for (i=0; i<DEVICE_INDEX_SIZE; i++)
+			if (DeviceIndex[i] == dev)
+			{
+				libusb_unref_device(dev);
+				DeviceIndex[i] = NULL;
+			}
+		goto end;
+	}
+
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		goto end;
+
+	/* not a supported reader */
+	id = (desc.idVendor << 16) + desc.idProduct;
+	if (NULL == bsearch(&id, DeviceIndexIDs, DeviceIndexIDsSize,
+		sizeof(DeviceIndexIDs[0]), compare_id))
+		goto end;
+
+	for (i=0; i<DEVICE_INDEX_SIZE; i++)
+		if (NULL == DeviceIndex[i])
+		{
+			DEBUG_COMM3("Index device: %d/%d", libusb_get_bus_number(dev),
+				libusb_get_device_address(dev));
+			DeviceIndex[i] = libusb_ref_device(dev);
+			break;
+		}
+
+end:
+	pthread_mutex_unlock(&DeviceIndexMutex);
+
+	/* keep the callback registered */
+	return 0;
+} /* device_index_cb */
+
+/*****************************************************************************
+ *
+ *					device_index_start
+ *
+ ****************************************************************************/
+static void device_index_start(list_t *ifdVendorID, list_t *ifdProductID)
+{
+	unsigned int alias;
+	int rv;
+
+	if (DeviceIndexActive || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+
+	DeviceIndexIDsSize = list_size(ifdVendorID);
+	DeviceIndexIDs = malloc(DeviceIndexIDsSize * sizeof(DeviceIndexIDs[0]));
+	if (NULL == DeviceIndexIDs)
+		return;
+
+	for (alias=0; alias<DeviceIndexIDsSize; alias++)
+		DeviceIndexIDs[alias] =
+			(strtoul(list_get_at(ifdVendorID, alias), NULL, 0) << 16)
+			+ strtoul(list_get_at(ifdProductID, alias), NULL, 0);
+	qsort(DeviceIndexIDs, DeviceIndexIDsSize, sizeof(DeviceIndexIDs[0]),
+		compare_id);
+
+	/* the callback is called for the devices already attached */
+	rv = libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, device_index_cb,
+		NULL, &DeviceIndexHandle);
+	if (rv != LIBUSB_SUCCESS)
+	{
+		DEBUG_INFO2("libusb_hotplug_register_callback failed: %s",
+			libusb_error_name(rv));
+		free(DeviceIndexIDs);
+		DeviceIndexIDs = NULL;
+		return;
+	}
+
+	DeviceIndexActive = true;
+} /* device_index_start */
+
+/*****************************************************************************
+ *
+ *					device_index_stop
+ *
+ ****************************************************************************/
+static void device_index_stop(void)
+{
+	int i;
+
+	if (! DeviceIndexActive)
+		return;
+
+	libusb_hotplug_deregister_callback(ctx, DeviceIndexHandle);
+
+	for (i=0; i<DEVICE_INDEX_SIZE; i++)
+		if (DeviceIndex[i])
+		{
+			libusb_unref_device(DeviceIndex[i]);
+			DeviceIndex[i] = NULL;
+		}
+
+	free(DeviceIndexIDs);
+	DeviceIndexIDs = NULL;
+	DeviceIndexActive = false;
+} /* device_index_stop */
+
+/*****************************************************************************
+ *
+ *					device_index_get_list
+ *
+ ****************************************************************************/
+static ssize_t device_index_get_list(unsigned int bus, unsigned int addr,
+	libusb_device ***list)
+{
+	struct timeval tv = { 0, 0 };
+	libusb_device **devs;
+	int i;
+
+	if (! DeviceIndexActive)
+		return 0;
+
+	/* process the pending hotplug events, without waiting */
+	(void)libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+
+	/* same format as libusb_get_device_list(): NULL terminated */
+	devs = calloc(2, sizeof(*devs));
+	if (NULL == devs)
+		return 0;
+
+	pthread_mutex_lock(&DeviceIndexMutex);
+	for (i=0; i<DEVICE_INDEX_SIZE; i++)
+		if (DeviceIndex[i]
+			&& (libusb_get_bus_number(DeviceIndex[i]) == bus)
+			&& (libusb_get_device_address(DeviceIndex[i]) == addr))
+		{
+			devs[0] = libusb_ref_device(DeviceIndex[i]);
+			break;
+		}
+	pthread_mutex_unlock(&DeviceIndexMutex);
+
+	if (NULL == devs[0])
+	{
+		/* not yet known, enumerate the bus */
+		free(devs);
+		return 0;
+	}
+
+	*list = devs;
+	return 1;
+} /* device_index_get_list */
+#endif
+
+/*****************************************************************************
+ *
+ *					free_device_list
+ *
+ ****************************************************************************/
+static void free_device_list(libusb_device **devs, bool from_index)
+{
+	if (from_index)
+	{
+		int i;
+
+		for (i=0; devs[i]; i++)
+			libusb_unref_device(devs[i]);
+		free(devs);
+	}
+	else
+		libusb_free_device_list(devs, 1);
+} /* free_device_list */
+
 /*****************************************************************************
  *
  *					close_libusb_if_needed
@@ -190,8 +487,13 @@ static void close_libusb_if_needed(void)
 {
 	bool to_exit = true;
 
+	pthread_mutex_lock(&PlistMutex);
+
 	if (NULL == ctx)
+	{
+		pthread_mutex_unlock(&PlistMutex);
 		return;
+	}
 
 	/* if at least 1 reader is still in use we do not exit libusb */
 	for (int i=0; i<CCID_DRIVER_MAX_READERS; i++)
@@ -202,10 +504,22 @@ static void close_libusb_if_needed(void)
 
 	if (to_exit)
 	{
+#ifdef USE_DEVICE_INDEX
+		device_index_stop();
+#endif
+		/* free bundle list */
+		if (plist_loaded)
+		{
+			bundleRelease(&plist);
+			plist_loaded = false;
+		}
+
 		DEBUG_INFO1("libusb_exit");
 		libusb_exit(ctx);
 		ctx = NULL;
 	}
+
+	pthread_mutex_unlock(&PlistMutex);
 } /* close_libusb_if_needed */
 
 /*****************************************************************************
@@ -245,7 +559,8 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 	static int previous_reader_index = -1;
 	libusb_device **devs, *dev;
 	ssize_t cnt;
-	list_t plist, *values, *ifdVendorID, *ifdProductID, *ifdFriendlyName;
+	bool from_index = false;
+	list_t *values, *ifdVendorID, *ifdProductID, *ifdFriendlyName;
 	int rv;
 	bool claim_failed = false;
 	int return_value = STATUS_SUCCESS;
@@ -323,9 +638,19 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 		hpDirPath, BUNDLE);
 	DEBUG_INFO2("Using: " LOG_STRING, infofile);
 
-	rv = bundleParse(infofile, &plist);
-	if (rv)
-		return STATUS_UNSUCCESSFUL;
+	/* released before any return or close_libusb_if_needed() */
+	pthread_mutex_lock(&PlistMutex);
+
+	if (! plist_loaded)
+	{
+		rv = bundleParse(infofile, &plist);
+		if (rv)
+		{
+			pthread_mutex_unlock(&PlistMutex);
+			return STATUS_UNSUCCESSFUL;
+		}
+		plist_loaded = true;
+	}
 
 #define GET_KEY(key, values) \
 	rv = LTPBundleFindValueWithKey(&plist, key, &values); \
@@ -376,10 +701,23 @@ status_t OpenUSBByName(unsigned int reader_index, /*@null@*/ char *device)
 		goto end1;
 	}
 
+#ifdef USE_DEVICE_INDEX
+	device_index_start(ifdVendorID, ifdProductID);
+#endif
+
 #ifdef __APPLE__
 again_libusb:
 #endif
-	cnt = libusb_get_device_list(ctx, &devs);
+#ifdef USE_DEVICE_INDEX
+	/* the device is known by its bus and address: look in the index */
+	if (device_bus || device_addr)
+	{
+		cnt = device_index_get_list(device_bus, device_addr, &devs);
+		from_index = (cnt > 0);
+	}
+#endif
+	if (! from_index)
+		cnt = libusb_get_device_list(ctx, &devs);
 	if (cnt < 0)
 	{
 		DEBUG_CRITICAL("libusb_get_device_list() failed\n");
@@ -450,14 +788,24 @@ again_libusb:
 				/* use the first CCID interface on first call */
 				static int static_interface = -1;
 				int max_interface_number = -1;
+				struct data_rates_prefetch prefetch[COMPOSITE_MAX_INTERFACES];
+				int nb_prefetch = 0;
 
 				/*
-				 * We can't talk to the two CCID interfaces
-				 * at the same time (the reader enters a
-				 * dead lock). So we simulate a multi slot
-				 * reader. By default multi slot readers
-				 * can't use the slots at the same time. See
-				 * TAG_IFD_SLOT_THREAD_SAFE
+				 * With the Gemalto Prox-DU and Prox-SU we
+				 * can't talk to the two CCID interfaces at
+				 * the same time (the reader enters a dead
+				 * lock). So we simulate a multi slot reader.
+				 * By default multi slot readers can't use the
+				 * slots at the same time. See
+				 * TAG_IFD_SLOT_THREAD_SAFE and
+				 * QUIRK_COMPOSITE_EXCLUSIVE.
+				 *
+				 * The other composite readers below are
+				 * simulated the same way but their
+				 * interfaces are independent
+				 * (QUIRK_COMPOSITE_CONCURRENT) and can be
+				 * used at the same time.
 				 *
 				 * One side effect is that the two readers
 				 * are seen by pcscd as one reader so the
@@ -547,16 +895,8 @@ again_libusb:
 							|| ((GEMCORESIMPRO == readerID)
 							&& (usbDevice[reader_index].ccid.IFD_bcdDevice < 0x0200)))
 						{
-							/* Allocate a memory buffer that will be
-							 * released in CloseUSB() */
-							void *ptr = malloc(sizeof SerialCustomDataRates);
-							if (ptr)
-							{
-								memcpy(ptr, SerialCustomDataRates,
-									sizeof SerialCustomDataRates);
-							}
-
-							usbDevice[reader_index].ccid.arrayOfSupportedDataRates = ptr;
+							/* not released in CloseUSB() */
+							usbDevice[reader_index].ccid.arrayOfSupportedDataRates = SerialCustomDataRates;
 							usbDevice[reader_index].ccid.dwMaxDataRate = 125000;
 						}
 
@@ -598,7 +938,6 @@ again_libusb:
 					continue;
 				}
 
-again:
 				r = libusb_get_active_config_descriptor(dev, &config_desc);
 				if (r < 0)
 				{
@@ -639,7 +978,7 @@ again:
 				}
 #endif
 
-
+next_interface:
 				usb_interface = get_ccid_usb_interface(config_desc, &num);
 				if (usb_interface == NULL)
 				{
@@ -666,7 +1005,6 @@ again:
 				interface = usb_interface->altsetting->bInterfaceNumber;
 				if (interface_number >= 0 && interface != interface_number)
 				{
-					libusb_free_config_descriptor(config_desc);
 					/* an interface was specified and it is not the
 					 * current one */
 					DEBUG_INFO3("Found interface %d but expecting %d",
@@ -674,10 +1012,12 @@ again:
 					DEBUG_INFO3("Wrong interface for USB device %d/%d."
 						" Checking next one.", bus_number, device_address);
 
-					/* check for another CCID interface on the same device */
+					/* check for another CCID interface on the same device
+					 * The config descriptor is still valid, no need to
+					 * get it again */
 					num++;
 
-					goto again;
+					goto next_interface;
 				}
 
 				r = libusb_claim_interface(dev_handle, interface);
@@ -747,6 +1087,7 @@ again:
 				usbDevice[reader_index].ccid.pbSeq = &usbDevice[reader_index].ccid.real_bSeq;
 				usbDevice[reader_index].ccid.readerID =
 					(desc.idVendor << 16) + desc.idProduct;
+				usbDevice[reader_index].ccid.IFD_bcdDevice = desc.bcdDevice;
 				usbDevice[reader_index].ccid.dwFeatures = dw2i(device_descriptor, 40);
 				usbDevice[reader_index].ccid.wLcdLayout =
 					(device_descriptor[51] << 8) + device_descriptor[50];
@@ -759,17 +1100,37 @@ again:
 				usbDevice[reader_index].ccid.bMaxCCIDBusySlots = device_descriptor[53];
 				usbDevice[reader_index].ccid.bCurrentSlotIndex = 0;
 				usbDevice[reader_index].ccid.readTimeout = DEFAULT_COM_READ_TIMEOUT;
+				usbDevice[reader_index].ccid.xfrLatencySamples = 0;
+				usbDevice[reader_index].ccid.bAbortFailed = false;
+				usbDevice[reader_index].data_rates_cache = -1;
+#ifdef USE_COMPOSITE_AS_MULTISLOT
+				/* The other CCID interfaces are opened later as the
+				 * next slots. Get their data rates now, at the same
+				 * time as the data rates of this interface */
+				if (ccid_get_quirks(readerID, desc.bcdDevice) & QUIRK_COMPOSITE_CONCURRENT)
+					nb_prefetch = data_rates_prefetch_start(dev_handle,
+						config_desc, num, readerID, desc.bcdDevice, prefetch);
+#endif
 				if (device_descriptor[27])
-					usbDevice[reader_index].ccid.arrayOfSupportedDataRates = get_data_rates(reader_index, config_desc, num);
+					usbDevice[reader_index].ccid.arrayOfSupportedDataRates = get_cached_data_rates(reader_index, config_desc, num);
 				else
 				{
 					usbDevice[reader_index].ccid.arrayOfSupportedDataRates = NULL;
 					DEBUG_INFO1("bNumDataRatesSupported is 0");
 				}
+#ifdef USE_COMPOSITE_AS_MULTISLOT
+				data_rates_prefetch_end(prefetch, nb_prefetch, readerID,
+					desc.bcdDevice);
+#endif
 				usbDevice[reader_index].ccid.bInterfaceProtocol = usb_interface->altsetting->bInterfaceProtocol;
 				usbDevice[reader_index].ccid.bNumEndpoints = usb_interface->altsetting->bNumEndpoints;
+				usbDevice[reader_index].ccid.iccdBusyTime = 0;
+				usbDevice[reader_index].ccid.iccdIns = 0;
+				memset(usbDevice[reader_index].ccid.iccdBusyTimeIns, 0,
+					sizeof usbDevice[reader_index].ccid.iccdBusyTimeIns);
 				usbDevice[reader_index].ccid.dwSlotStatus = IFD_ICC_PRESENT;
 				usbDevice[reader_index].ccid.bVoltageSupport = device_descriptor[5];
+				usbDevice[reader_index].ccid.learnedVoltage = -1;
 				usbDevice[reader_index].ccid.sIFD_serial_number = NULL;
 				usbDevice[reader_index].ccid.gemalto_firmware_features = NULL;
 				usbDevice[reader_index].ccid.dwProtocols = dw2i(device_descriptor, 6);
@@ -803,8 +1164,6 @@ again:
 							= strdup((char *)iManufacturer);
 				}
 
-				usbDevice[reader_index].ccid.IFD_bcdDevice = desc.bcdDevice;
-
 				/* If this is a multislot reader, init the multislot stuff */
 				if (usbDevice[reader_index].ccid.bMaxSlotIndex)
 					usbDevice[reader_index].multislot_extension = Multi_CreateFirstSlot(reader_index);
@@ -820,7 +1179,7 @@ end:
 	if (usbDevice[reader_index].dev_handle == NULL)
 	{
 		/* free the libusb allocated list & devices */
-		libusb_free_device_list(devs, 1);
+		free_device_list(devs, from_index);
 
 #ifdef __APPLE__
 		/* give some time to libusb to detect the new USB devices on Mac OS X */
@@ -834,10 +1193,8 @@ end:
 		}
 #endif
 
-		/* free bundle list */
-		bundleRelease(&plist);
-
 		/* failed */
+		pthread_mutex_unlock(&PlistMutex);
 		close_libusb_if_needed();
 
 		if (claim_failed)
@@ -852,11 +1209,10 @@ end:
 
 end2:
 	/* free the libusb allocated list & devices */
-	libusb_free_device_list(devs, 1);
+	free_device_list(devs, from_index);
 
 end1:
-	/* free bundle list */
-	bundleRelease(&plist);
+	pthread_mutex_unlock(&PlistMutex);
 
 	if (return_value != STATUS_SUCCESS)
 		close_libusb_if_needed();
@@ -875,6 +1231,7 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
 {
 	int rv;
 	int actual_length;
+	uint64_t start;
 	char debug_header[] = "-> 121234 ";
 
 	(void)snprintf(debug_header, sizeof(debug_header), "-> %06X ",
@@ -900,9 +1257,11 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
 
 	DEBUG_XXD(debug_header, buffer, length);
 
+	start = get_time_us();
 	rv = libusb_bulk_transfer(usbDevice[reader_index].dev_handle,
 		usbDevice[reader_index].bulk_out, buffer, length,
 		&actual_length, USB_WRITE_TIMEOUT);
+	Counters[reader_index].transport_time_us += get_time_us() - start;
 
 	if (rv < 0)
 	{
@@ -910,12 +1269,18 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
 			usbDevice[reader_index].bus_number,
 			usbDevice[reader_index].device_address, libusb_error_name(rv));
 
+		if (LIBUSB_ERROR_TIMEOUT == rv)
+			Counters[reader_index].timeouts++;
+
 		if (LIBUSB_ERROR_NO_DEVICE == rv)
 			return STATUS_NO_SUCH_DEVICE;
 
 		return STATUS_UNSUCCESSFUL;
 	}
 
+	Counters[reader_index].messages_out++;
+	Counters[reader_index].bytes_out += length;
+
 	return STATUS_SUCCESS;
 } /* WriteUSB */
 
@@ -927,6 +1292,30 @@ status_t WriteUSB(unsigned int reader_index, unsigned int length,
  ****************************************************************************/
 status_t ReadUSB(unsigned int reader_index, unsigned int * length,
 	unsigned char *buffer, int bSeq)
+{
+	uint64_t start = get_time_us();
+	status_t ret;
+
+	ret = ReadUSBFrame(reader_index, length, buffer, bSeq);
+
+	Counters[reader_index].transport_time_us += get_time_us() - start;
+	if (STATUS_SUCCESS == ret)
+	{
+		Counters[reader_index].messages_in++;
+		Counters[reader_index].bytes_in += *length;
+	}
+
+	return ret;
+} /* ReadUSB */
+
+
+/*****************************************************************************
+ *
+ *					ReadUSBFrame
+ *
+ ****************************************************************************/
+static status_t ReadUSBFrame(unsigned int reader_index, unsigned int * length,
+	unsigned char *buffer, int bSeq)
 {
 	int rv;
 	int actual_length;
@@ -947,13 +1336,15 @@ read_again:
 	{
 		/* multi slot read */
 		int slot = usbDevice[reader_index].ccid.bCurrentSlotIndex;
-		struct multiSlot_ConcurrentAccess *concurrent = usbDevice[reader_index].multislot_extension->concurrent;
+		struct usbDevice_MultiSlot_Extension *msExt = usbDevice[reader_index].multislot_extension;
+		struct multiSlot_ConcurrentAccess *concurrent = msExt->concurrent;
+		struct multiSlot_Frame *frame;
 
 		rv = 0;
 		pthread_mutex_lock(&concurrent[slot].mutex);
 
 		/* a frame is available? */
-		if (0 == concurrent[slot].length)
+		if (NULL == concurrent[slot].frame)
 		{
 			struct timespec timeout;
 			time_t timeout_sec = usbDevice[reader_index].ccid.readTimeout  / 1000;
@@ -974,6 +1365,9 @@ read_again:
 				&concurrent[slot].mutex, &timeout);
 		}
 
+		frame = concurrent[slot].frame;
+		concurrent[slot].frame = NULL;
+
 		if (rv)
 		{
 			*length = 0;
@@ -983,17 +1377,15 @@ read_again:
 		}
 		else
 		{
-			DEBUG_COMM3("Got %d bytes for slot %d", concurrent[slot].length,
-				slot);
-			if (concurrent[slot].length > 0)
+			if (frame)
 			{
-				if (concurrent[slot].length > (int)*length)
+				DEBUG_COMM3("Got %d bytes for slot %d", frame->length, slot);
+				if (frame->length > (int)*length)
 					DEBUG_CRITICAL3("Received %d bytes but expected only %d",
-						concurrent[slot].length, *length);
+						frame->length, *length);
 				else
-					*length = concurrent[slot].length;
-				memcpy(buffer, concurrent[slot].buffer, *length);
-				concurrent[slot].length = 0;
+					*length = frame->length;
+				memcpy(buffer, frame->buffer, *length);
 			}
 			else
 				rv = EINTR;
@@ -1001,6 +1393,12 @@ read_again:
 
 		pthread_mutex_unlock(&concurrent[slot].mutex);
 
+		/* give the frame back, even a late one */
+		Multi_PutFrame(msExt, frame);
+
+		if (ETIMEDOUT == rv)
+			Counters[reader_index].timeouts++;
+
 		if (rv)
 			return STATUS_UNSUCCESSFUL;
 	}
@@ -1018,6 +1416,9 @@ read_again:
 				usbDevice[reader_index].device_address,
 				libusb_error_name(rv));
 
+			if (LIBUSB_ERROR_TIMEOUT == rv)
+				Counters[reader_index].timeouts++;
+
 			if (LIBUSB_ERROR_NO_DEVICE == rv)
 				return STATUS_NO_SUCH_DEVICE;
 
@@ -1041,11 +1442,12 @@ read_again:
 			return STATUS_UNSUCCESSFUL;
 		}
 		DEBUG_INFO1("Invalid frame detected");
+		Counters[reader_index].duplicate_frames++;
 		goto read_again;
 	}
 
 	return STATUS_SUCCESS;
-} /* ReadUSB */
+} /* ReadUSBFrame */
 
 
 /*****************************************************************************
@@ -1099,9 +1501,20 @@ status_t CloseUSB(unsigned int reader_index)
 				/* Create mutex and condition object for the concurrent read */
 				pthread_cond_destroy(&concurrent[slot].condition);
 				pthread_mutex_destroy(&concurrent[slot].mutex);
+				free(concurrent[slot].frame);
 			}
 			free(concurrent);
 
+			/* release the free frames */
+			while (msExt->pool)
+			{
+				struct multiSlot_Frame *next = msExt->pool->next;
+
+				free(msExt->pool);
+				msExt->pool = next;
+			}
+			pthread_mutex_destroy(&msExt->pool_mutex);
+
 			/* Deallocate the extension itself */
 			free(msExt);
 
@@ -1118,8 +1531,13 @@ status_t CloseUSB(unsigned int reader_index)
 		if (usbDevice[reader_index].ccid.sIFD_iManufacturer)
 			free(usbDevice[reader_index].ccid.sIFD_iManufacturer);
 
-		if (usbDevice[reader_index].ccid.arrayOfSupportedDataRates)
-			free(usbDevice[reader_index].ccid.arrayOfSupportedDataRates);
+		/* the data rates stay in the cache for a next open */
+		if (usbDevice[reader_index].data_rates_cache >= 0)
+		{
+			pthread_mutex_lock(&PlistMutex);
+			DataRatesCache[usbDevice[reader_index].data_rates_cache].refcount--;
+			pthread_mutex_unlock(&PlistMutex);
+		}
 
 		(void)libusb_release_interface(usbDevice[reader_index].dev_handle,
 			usbDevice[reader_index].interface);
@@ -1359,27 +1777,40 @@ bool ccid_check_firmware(struct libusb_device_descriptor *desc)
  *					get_data_rates
  *
  ****************************************************************************/
-static unsigned int *get_data_rates(unsigned int reader_index,
-	struct libusb_config_descriptor *desc, int num)
+static unsigned int *get_data_rates(libusb_device_handle *dev_handle,
+	struct libusb_config_descriptor *desc, int num, bool *transient)
 {
 	int n, i, len;
 	unsigned char buffer[256*sizeof(int)];	/* maximum is 256 records */
 	unsigned int *uint_array;
 	int bNumDataRatesSupported;
+	const struct libusb_interface *usb_interface;
+	int interface;
 
-	bNumDataRatesSupported = get_ccid_device_descriptor(get_ccid_usb_interface(desc, &num))[27];
+	usb_interface = get_ccid_usb_interface(desc, &num);
+	interface = usb_interface->altsetting->bInterfaceNumber;
+	bNumDataRatesSupported = get_ccid_device_descriptor(usb_interface)[27];
 	if (0 == bNumDataRatesSupported)
 		/* read up to the buffer size */
 		len = sizeof(buffer) / sizeof(int);
 	else
 		len = bNumDataRatesSupported;
 
-	/* See CCID 3.7.3 page 25 */
-	n = ControlUSB(reader_index,
+	/* See CCID 3.7.3 page 25
+	 * The usbDevice[] entry may not be used yet so ControlUSB() is not
+	 * used. This function is also called from the prefetch threads */
+	DEBUG_COMM2("GET_DATA_RATES on interface %d", interface);
+	n = libusb_control_transfer(dev_handle,
 		0xA1, /* request type */
 		0x03, /* GET_DATA_RATES */
 		0x00, /* value */
-		buffer, len * sizeof(int));
+		interface, buffer, len * sizeof(int), DEFAULT_COM_READ_TIMEOUT);
+	if (n > 0)
+		DEBUG_XXD("receive: ", buffer, n);
+
+	/* only a stall or an empty answer says the request is not supported.
+	 * A timeout or another USB error may not happen next time */
+	*transient = (n < 0) && (LIBUSB_ERROR_PIPE != n);
 
 	/* we got an error? */
 	if (n <= 0)
@@ -1412,6 +1843,7 @@ static unsigned int *get_data_rates(unsigned int reader_index,
 	if (NULL == uint_array)
 	{
 		DEBUG_CRITICAL("Memory allocation failed");
+		*transient = true;
 		return NULL;
 	}
 
@@ -1429,6 +1861,228 @@ static unsigned int *get_data_rates(unsigned int reader_index,
 } /* get_data_rates */
 
 
+/*****************************************************************************
+ *
+ *					data_rates_cache_find
+ *
+ ****************************************************************************/
+static int data_rates_cache_find(int readerID, int bcdDevice, int interface)
+{
+	int i;
+
+	for (i=0; i<DATA_RATES_CACHE_SIZE; i++)
+	{
+		if ((DataRatesCache[i].readerID == readerID)
+			&& (DataRatesCache[i].bcdDevice == bcdDevice)
+			&& (DataRatesCache[i].interface == interface))
+			return i;
+	}
+
+	return -1;
+} /* data_rates_cache_find */
+
+
+/*****************************************************************************
+ *
+ *					data_rates_cache_add
+ *
+ ****************************************************************************/
+static int data_rates_cache_add(int readerID, int bcdDevice, int interface,
+	unsigned int *rates)
+{
+	int i, free_entry = -1;
+
+	/* use an empty entry first, then an entry not used anymore */
+	for (i=0; i<DATA_RATES_CACHE_SIZE; i++)
+	{
+		if (0 == DataRatesCache[i].readerID)
+		{
+			free_entry = i;
+			break;
+		}
+
+		if ((free_entry < 0) && (0 == DataRatesCache[i].refcount))
+			free_entry = i;
+	}
+
+	if (free_entry < 0)
+	{
+		/* should not happen */
+		DEBUG_CRITICAL("Data rates cache full");
+		free(rates);
+		return -1;
+	}
+
+	/* replace the unused entry */
+	free(DataRatesCache[free_entry].rates);
+	DataRatesCache[free_entry].readerID = readerID;
+	DataRatesCache[free_entry].bcdDevice = bcdDevice;
+	DataRatesCache[free_entry].interface = interface;
+	DataRatesCache[free_entry].rates = rates;
+	DataRatesCache[free_entry].refcount = 0;
+
+	return free_entry;
+} /* data_rates_cache_add */
+
+
+/*****************************************************************************
+ *
+ *					get_cached_data_rates
+ *
+ ****************************************************************************/
+static unsigned int *get_cached_data_rates(unsigned int reader_index,
+	struct libusb_config_descriptor *desc, int num)
+{
+	_ccid_descriptor *ccid = &usbDevice[reader_index].ccid;
+	int i;
+	unsigned int *rates;
+	bool transient;
+
+	i = data_rates_cache_find(ccid->readerID, ccid->IFD_bcdDevice,
+		usbDevice[reader_index].interface);
+	if (i >= 0)
+		DEBUG_INFO1("Use the cached data rates");
+	else
+	{
+		rates = get_data_rates(usbDevice[reader_index].dev_handle, desc, num,
+			&transient);
+
+		/* do not cache a failure that may not happen with the next
+		 * reader */
+		if (transient)
+		{
+			DEBUG_INFO1("Data rates not cached");
+			return NULL;
+		}
+
+		i = data_rates_cache_add(ccid->readerID, ccid->IFD_bcdDevice,
+			usbDevice[reader_index].interface, rates);
+		if (i < 0)
+			return NULL;
+	}
+
+	DataRatesCache[i].refcount++;
+	usbDevice[reader_index].data_rates_cache = i;
+
+	return DataRatesCache[i].rates;
+} /* get_cached_data_rates */
+
+#ifdef USE_COMPOSITE_AS_MULTISLOT
+
+/*****************************************************************************
+ *
+ *					data_rates_prefetch_thread
+ *
+ ****************************************************************************/
+static void *data_rates_prefetch_thread(void *arg)
+{
+	struct data_rates_prefetch *prefetch = arg;
+
+	prefetch->rates = get_data_rates(prefetch->dev_handle, prefetch->desc,
+		prefetch->num, &prefetch->transient);
+
+	return NULL;
+} /* data_rates_prefetch_thread */
+
+
+/*****************************************************************************
+ *
+ *					data_rates_prefetch_start
+ *
+ * Send GET_DATA_RATES to the CCID interfaces of a composite reader, other
+ * than num, not yet in the cache. One thread per interface.
+ * Return the number of threads started.
+ *
+ ****************************************************************************/
+static int data_rates_prefetch_start(libusb_device_handle *dev_handle,
+	struct libusb_config_descriptor *desc, int num, int readerID,
+	int bcdDevice, struct data_rates_prefetch prefetch[])
+{
+	int i, nb = 0;
+
+	for (i=0; nb<COMPOSITE_MAX_INTERFACES; i++)
+	{
+		const struct libusb_interface *usb_interface;
+		const unsigned char *device_descriptor;
+		int interface, r;
+
+		usb_interface = get_ccid_usb_interface(desc, &i);
+		if (NULL == usb_interface)
+			break;
+
+		if (i == num)
+			continue;
+
+		/* bNumDataRatesSupported is 0: GET_DATA_RATES is not used */
+		device_descriptor = get_ccid_device_descriptor(usb_interface);
+		if ((NULL == device_descriptor) || (0 == device_descriptor[27]))
+			continue;
+
+		interface = usb_interface->altsetting->bInterfaceNumber;
+		if (data_rates_cache_find(readerID, bcdDevice, interface) >= 0)
+			continue;
+
+		/* the interface is claimed only for the request. It fails if
+		 * the interface is already opened by another slot */
+		r = libusb_claim_interface(dev_handle, interface);
+		if (r < 0)
+		{
+			DEBUG_INFO3("Can't claim interface %d: %s", interface,
+				libusb_error_name(r));
+			continue;
+		}
+
+		prefetch[nb].dev_handle = dev_handle;
+		prefetch[nb].desc = desc;
+		prefetch[nb].num = i;
+		prefetch[nb].interface = interface;
+		prefetch[nb].rates = NULL;
+		prefetch[nb].transient = true;
+		if (pthread_create(&prefetch[nb].thread, NULL,
+			data_rates_prefetch_thread, &prefetch[nb]))
+		{
+			DEBUG_CRITICAL("pthread_create failed");
+			(void)libusb_release_interface(dev_handle, interface);
+			continue;
+		}
+
+		nb++;
+	}
+
+	return nb;
+} /* data_rates_prefetch_start */
+
+
+/*****************************************************************************
+ *
+ *					data_rates_prefetch_end
+ *
+ * Wait for the threads started by data_rates_prefetch_start() and store
+ * the data rates in the cache for the next slots
+ *
+ ****************************************************************************/
+static void data_rates_prefetch_end(struct data_rates_prefetch prefetch[],
+	int nb, int readerID, int bcdDevice)
+{
+	int i;
+
+	for (i=0; i<nb; i++)
+	{
+		pthread_join(prefetch[i].thread, NULL);
+		(void)libusb_release_interface(prefetch[i].dev_handle,
+			prefetch[i].interface);
+
+		if (prefetch[i].transient)
+			DEBUG_INFO2("Data rates of interface %d not cached",
+				prefetch[i].interface);
+		else
+			(void)data_rates_cache_add(readerID, bcdDevice,
+				prefetch[i].interface, prefetch[i].rates);
+	}
+} /* data_rates_prefetch_end */
+#endif
+
+
 /*****************************************************************************
  *
  *					ControlUSB
@@ -1930,10 +2584,9 @@ static void *Multi_ReadProc(void *p_ext)
 {
 	struct usbDevice_MultiSlot_Extension *msExt;
 	struct multiSlot_ConcurrentAccess *concurrent;
+	struct multiSlot_Frame *frame = NULL;
 	int reader_index;
 	int rv;
-	unsigned char buffer[10 + MAX_BUFFER_SIZE_EXTENDED];
-	int length;
 
 	msExt = p_ext;
 	concurrent = msExt->concurrent;
@@ -1946,11 +2599,23 @@ static void *Multi_ReadProc(void *p_ext)
 	while (! msExt->terminated)
 	{
 		int slot;
+		struct multiSlot_Frame *unread;
+
+		if (NULL == frame)
+		{
+			frame = Multi_GetFrame(msExt);
+			if (NULL == frame)
+			{
+				/* wait a bit and try again */
+				(void)usleep(100*1000);
+				continue;
+			}
+		}
 
 		DEBUG_COMM2("Waiting read for reader %d", reader_index);
 		rv = libusb_bulk_transfer(msExt->dev_handle,
-			usbDevice[reader_index].bulk_in, buffer, sizeof buffer,
-			&length, 5 * 1000);
+			usbDevice[reader_index].bulk_in, frame->buffer, msExt->frame_size,
+			&frame->length, 5 * 1000);
 
 		if (rv < 0)
 		{
@@ -1980,20 +2645,33 @@ static void *Multi_ReadProc(void *p_ext)
 		}
 
 #define BSLOT_OFFSET 5
-		slot = buffer[BSLOT_OFFSET];
-		DEBUG_COMM3("Read %d bytes for slot %d", length, slot);
+		slot = frame->buffer[BSLOT_OFFSET];
+		DEBUG_COMM3("Read %d bytes for slot %d", frame->length, slot);
+
+		if ((frame->length <= BSLOT_OFFSET)
+			|| (slot > usbDevice[reader_index].ccid.bMaxSlotIndex))
+		{
+			DEBUG_CRITICAL2("Invalid frame for slot %d", slot);
+			continue;
+		}
 
-		/* copy and signal */
+		/* give the frame to the slot and signal */
 		pthread_mutex_lock(&concurrent[slot].mutex);
 
-		memcpy(concurrent[slot].buffer, buffer, length);
-		concurrent[slot].length = length;
+		unread = concurrent[slot].frame;
+		concurrent[slot].frame = frame;
 		pthread_cond_signal(&concurrent[slot].condition);
 		DEBUG_COMM3("Signaled reader %d slot %d", reader_index, slot);
 
 		pthread_mutex_unlock(&concurrent[slot].mutex);
+
+		/* a frame not read by the slot is replaced, as before. Its
+		 * memory is used for the next read */
+		frame = unread;
 	}
 
+	Multi_PutFrame(msExt, frame);
+
 	DEBUG_COMM3("Multi_ReadProc (%d/%d): Thread terminated",
 		usbDevice[reader_index].bus_number,
 		usbDevice[reader_index].device_address);
@@ -2030,6 +2708,17 @@ static struct usbDevice_MultiSlot_Extension *Multi_CreateFirstSlot(int reader_in
 	pthread_mutex_init(&msExt->mutex, NULL);
 	pthread_cond_init(&msExt->condition, NULL);
 
+	/* Frames are sized for the longest message the reader can send,
+	 * rounded up to a multiple of a high speed USB bulk packet */
+	msExt->pool = NULL;
+	pthread_mutex_init(&msExt->pool_mutex, NULL);
+	msExt->frame_size = max(usbDevice[reader_index].ccid.dwMaxCCIDMessageLength,
+		10 + MAX_BUFFER_SIZE);
+	msExt->frame_size = (msExt->frame_size + 511) / 512 * 512;
+	if (msExt->frame_size > 10 + MAX_BUFFER_SIZE_EXTENDED)
+		msExt->frame_size = 10 + MAX_BUFFER_SIZE_EXTENDED;
+	DEBUG_INFO2("Multi slot frame size: %d", msExt->frame_size);
+
 	/* concurrent USB read */
 	concurrent = calloc(usbDevice[reader_index].ccid.bMaxSlotIndex +1,
 		sizeof(struct multiSlot_ConcurrentAccess));
@@ -2067,3 +2756,48 @@ static struct usbDevice_MultiSlot_Extension *Multi_CreateNextSlot(int physical_r
 	return usbDevice[physical_reader_index].multislot_extension;
 } /* Multi_CreateNextSlot */
 
+
+/*****************************************************************************
+ *
+ *					Multi_GetFrame
+ *
+ ****************************************************************************/
+static struct multiSlot_Frame *Multi_GetFrame(struct usbDevice_MultiSlot_Extension *msExt)
+{
+	struct multiSlot_Frame *frame;
+
+	pthread_mutex_lock(&msExt->pool_mutex);
+	frame = msExt->pool;
+	if (frame)
+		msExt->pool = frame->next;
+	pthread_mutex_unlock(&msExt->pool_mutex);
+
+	/* the pool is empty */
+	if (NULL == frame)
+	{
+		frame = malloc(sizeof *frame + msExt->frame_size);
+		if (NULL == frame)
+			DEBUG_CRITICAL("malloc failed");
+	}
+
+	return frame;
+} /* Multi_GetFrame */
+
+
+/*****************************************************************************
+ *
+ *					Multi_PutFrame
+ *
+ ****************************************************************************/
+static void Multi_PutFrame(struct usbDevice_MultiSlot_Extension *msExt,
+	struct multiSlot_Frame *frame)
+{
+	if (NULL == frame)
+		return;
+
+	pthread_mutex_lock(&msExt->pool_mutex);
+	frame->next = msExt->pool;
+	msExt->pool = frame;
+	pthread_mutex_unlock(&msExt->pool_mutex);
+} /* Multi_PutFrame */
+
@@ -33,6 +33,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <pthread.h>
 
 #include <pcsclite.h>
 #include <ifdhandler.h>
@@ -46,6 +47,7 @@
 #include "ccid_ifdhandler.h"
 #include "debug.h"
 #include "utils.h"
+#include "counters.h"
 
 /* All the pinpad readers I used are more or less bogus
  * I use code to change the user command and make the firmware happy */
@@ -60,6 +62,15 @@
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 #endif
 
+/* DRIVER_OPTION_ADAPTIVE_TIMEOUT: number of responses to measure before
+ * using the learned timeout and minimum timeout (in ms) */
+#define ADAPTIVE_TIMEOUT_SAMPLES	8
+#define ADAPTIVE_TIMEOUT_MIN	1000
+
+/* ICCD busy polling, values in microseconds */
+#define ICCD_POLL_MIN_DELAY	500
+#define ICCD_POLL_MAX_DELAY	(10 * 1000)
+
 #define CHECK_STATUS(res) \
 	if (STATUS_NO_SUCH_DEVICE == res) \
 		return IFD_NO_SUCH_DEVICE; \
@@ -83,6 +94,76 @@ static RESPONSECODE CmdXfrBlockTPDU_T1(unsigned int reader_index,
 	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
 	unsigned char rx_buffer[]);
 
+static RESPONSECODE CmdXfrBlockNotSupported(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[]);
+
+static RESPONSECODE CmdXfrBlockUnknown(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[]);
+
+/* XfrBlock function for T=0, T=1 and any other protocol, set once by
+ * SetXfrBlock() from the exchange level of the reader */
+#define XFR_PROTOCOL_OTHER 2
+typedef RESPONSECODE (*XfrBlock_t)(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[]);
+static XfrBlock_t XfrBlock[CCID_DRIVER_MAX_READERS][XFR_PROTOCOL_OTHER+1];
+
+#ifndef TWIN_SERIAL
+static unsigned int ICCD_NextDelay(unsigned int learned, unsigned int waited,
+	unsigned int delay);
+static void ICCD_LearnBusyTime(unsigned int *learned, unsigned int waited,
+	unsigned int delay);
+static void ICCD_A_Wait(unsigned int reader_index, unsigned int delay);
+#endif
+static unsigned int adaptive_timeout(_ccid_descriptor *ccid_descriptor);
+static void update_latency(_ccid_descriptor *ccid_descriptor,
+	uint64_t start);
+static RESPONSECODE CCID_ReceiveSeq(unsigned int reader_index,
+	unsigned int *rx_length, unsigned char rx_buffer[],
+	unsigned char *chain_parameter, int bSeq, bool adaptive);
+static RESPONSECODE CmdAbortRequest(unsigned int reader_index, int *bSeq);
+static RESPONSECODE CmdAbortResponse(unsigned int reader_index, int bSeq,
+	unsigned char buffer[], unsigned int size);
+
+/*
+ * Secure PIN operation started by SecurePINStart(). The response of the
+ * reader is received by a thread so the slot is not blocked while the
+ * user types the PIN.
+ */
+struct secure_pin
+{
+	unsigned int reader_index;
+	bool verify;	/* PIN verification or PIN modification */
+	int bSeq;	/* bSeq of the PC_to_RDR_Secure command */
+	unsigned int timeout;	/* in ms */
+	bool threaded;	/* thread created (and not yet joined) */
+	pthread_t thread;
+
+	/* protected by mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	bool done;
+	RESPONSECODE ret;
+	unsigned int length;
+	unsigned char buffer[MAX_BUFFER_SIZE];
+};
+
+static RESPONSECODE SecurePINVerifyCommand(unsigned int reader_index,
+	unsigned char TxBuffer[], unsigned int TxLength,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin);
+static RESPONSECODE SecurePINModifyCommand(unsigned int reader_index,
+	unsigned char TxBuffer[], unsigned int TxLength,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin);
+static RESPONSECODE SecurePINSend(unsigned int reader_index,
+	unsigned char cmd[], unsigned int length, unsigned int timeout,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin);
+static RESPONSECODE SecurePINReceive(unsigned int reader_index, bool verify,
+	int bSeq, unsigned int timeout, unsigned char RxBuffer[],
+	unsigned int *RxLength);
+static void *SecurePINProc(void *p_pin);
+static void SecurePINRelease(unsigned int reader_index);
 static void i2dw(int value, unsigned char *buffer);
 static unsigned int bei2i(unsigned char *buffer);
 
@@ -300,6 +381,9 @@ again:
 	/* the buffer length should be 10 + MAX_ATR_SIZE */
 	memmove(buffer, buffer+10, atr_len);
 
+	/* try this voltage first next time */
+	ccid_descriptor->learnedVoltage = voltage;
+
 	return return_value;
 } /* CmdPowerOn */
 
@@ -312,17 +396,31 @@ again:
 RESPONSECODE SecurePINVerify(unsigned int reader_index,
 	unsigned char TxBuffer[], unsigned int TxLength,
 	unsigned char RxBuffer[], unsigned int *RxLength)
+{
+	return SecurePINVerifyCommand(reader_index, TxBuffer, TxLength,
+		RxBuffer, RxLength, NULL);
+} /* SecurePINVerify */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINVerifyCommand
+ *
+ ****************************************************************************/
+static RESPONSECODE SecurePINVerifyCommand(unsigned int reader_index,
+	unsigned char TxBuffer[], unsigned int TxLength,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin)
 {
 	unsigned char cmd[11+14+TxLength];
 	unsigned int a, b;
 	PIN_VERIFY_STRUCTURE *pvs;
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
-	int old_read_timeout;
-	RESPONSECODE ret;
-	status_t res;
-
 	uint32_t ulDataLength;
 
+	/* the pinpad may need its setup first. The first PIN command is
+	 * then slower: it also uploads the l10n strings */
+	(void)ccid_open_hack_deferred(reader_index);
+
 	pvs = (PIN_VERIFY_STRUCTURE *)TxBuffer;
 	cmd[0] = 0x69;	/* Secure */
 	cmd[5] = ccid_descriptor->bCurrentSlotIndex;	/* slot number */
@@ -504,111 +602,10 @@ RESPONSECODE SecurePINVerify(unsigned int reader_index,
 
 	i2dw(a - 10, cmd + 1);  /* CCID message length */
 
-	old_read_timeout = ccid_descriptor -> readTimeout;
-	ccid_descriptor -> readTimeout = max(90, TxBuffer[0]+10)*1000;	/* at least 90 seconds */
-
-	res = WritePort(reader_index, a, cmd);
-	if (STATUS_SUCCESS != res)
-	{
-		if (STATUS_NO_SUCH_DEVICE == res)
-			ret = IFD_NO_SUCH_DEVICE;
-		else
-			ret = IFD_COMMUNICATION_ERROR;
-		goto end;
-	}
-
-	ret = CCID_Receive(reader_index, RxLength, RxBuffer, NULL);
-
-	/* T=1 Protocol Management for a TPDU reader */
-	if ((SCARD_PROTOCOL_T1 == ccid_descriptor->cardProtocol)
-		&& (CCID_CLASS_TPDU == (ccid_descriptor->dwFeatures & CCID_CLASS_EXCHANGE_MASK)))
-	{
-		/* timeout and cancel cases are faked by CCID_Receive() */
-		if ((2 == *RxLength)
-			/* the CCID command is rejected or failed */
-		   || (IFD_SUCCESS != ret))
-		{
-			/* Decrement the sequence numbers since no TPDU was sent */
-			get_ccid_slot(reader_index)->t1.ns ^= 1;
-			get_ccid_slot(reader_index)->t1.nr ^= 1;
-		}
-		else
-		{
-			/* FIXME: manage T=1 error blocks */
-
-			/* defines from openct/proto-t1.c */
-			#define PCB 1
-			#define DATA 3
-			#define T1_S_BLOCK		0xC0
-			#define T1_S_RESPONSE		0x20
-			#define T1_S_TYPE(pcb)		((pcb) & 0x0F)
-			#define T1_S_WTX		0x03
-
-			/* WTX S-block */
-			if ((T1_S_BLOCK | T1_S_WTX) == RxBuffer[PCB])
-			{
-/*
- * The Swiss health care card sends a WTX request before returning the
- * SW code. If the reader is in TPDU the driver must manage the request
- * itself.
- *
- * received: 00 C3 01 09 CB
- * openct/proto-t1.c:432:t1_transceive() S-Block request received
- * openct/proto-t1.c:489:t1_transceive() CT sent S-block with wtx=9
- * sending: 00 E3 01 09 EB
- * openct/proto-t1.c:667:t1_xcv() New timeout at WTX request: 23643 sec
- * received: 00 40 02 90 00 D2
-*/
-				ct_buf_t tbuf;
-				unsigned char sblk[1]; /* we only need 1 byte of data */
-				t1_state_t *t1 = &get_ccid_slot(reader_index)->t1;
-				unsigned int slen;
-				int oldReadTimeout;
-
-				DEBUG_COMM2("CT sent S-block with wtx=%u", RxBuffer[DATA]);
-				t1->wtx = RxBuffer[DATA];
-
-				oldReadTimeout = ccid_descriptor->readTimeout;
-				if (t1->wtx > 1)
-				{
-					/* set the new temporary timeout at WTX card request */
-					ccid_descriptor->readTimeout *= t1->wtx;
-					DEBUG_INFO2("New timeout at WTX request: %d sec",
-							ccid_descriptor->readTimeout);
-				}
-
-				ct_buf_init(&tbuf, sblk, sizeof(sblk));
-				t1->wtx = RxBuffer[DATA];
-				ct_buf_putc(&tbuf, RxBuffer[DATA]);
-
-				slen = t1_build(t1, RxBuffer, 0,
-					T1_S_BLOCK | T1_S_RESPONSE | T1_S_TYPE(RxBuffer[PCB]),
-					&tbuf, NULL);
-
-				ret = CCID_Transmit(t1 -> lun, slen, RxBuffer, 0, t1->wtx);
-				if (ret != IFD_SUCCESS)
-					return ret;
-
-				/* I guess we have at least 6 bytes in RxBuffer */
-				*RxLength = 6;
-				ret = CCID_Receive(reader_index, RxLength, RxBuffer, NULL);
-				if (ret != IFD_SUCCESS)
-					return ret;
-
-				/* Restore initial timeout */
-				ccid_descriptor->readTimeout = oldReadTimeout;
-			}
-
-			/* get only the T=1 data */
-			memmove(RxBuffer, RxBuffer+3, *RxLength -4);
-			*RxLength -= 4;	/* remove NAD, PCB, LEN and CRC */
-		}
-	}
-
-end:
-	ccid_descriptor -> readTimeout = old_read_timeout;
-	return ret;
-} /* SecurePINVerify */
+	/* at least 90 seconds */
+	return SecurePINSend(reader_index, cmd, a, max(90, TxBuffer[0]+10)*1000,
+		RxBuffer, RxLength, pin);
+} /* SecurePINVerifyCommand */
 
 
 #ifdef BOGUS_PINPAD_FIRMWARE
@@ -657,20 +654,35 @@ static int has_gemalto_modify_pin_bug(_ccid_descriptor *ccid_descriptor)
 RESPONSECODE SecurePINModify(unsigned int reader_index,
 	unsigned char TxBuffer[], unsigned int TxLength,
 	unsigned char RxBuffer[], unsigned int *RxLength)
+{
+	return SecurePINModifyCommand(reader_index, TxBuffer, TxLength,
+		RxBuffer, RxLength, NULL);
+} /* SecurePINModify */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINModifyCommand
+ *
+ ****************************************************************************/
+static RESPONSECODE SecurePINModifyCommand(unsigned int reader_index,
+	unsigned char TxBuffer[], unsigned int TxLength,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin)
 {
 	unsigned char cmd[11+19+TxLength];
 	unsigned int a, b;
 	PIN_MODIFY_STRUCTURE *pms;
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
-	int old_read_timeout;
-	RESPONSECODE ret;
-	status_t res;
 #ifdef BOGUS_PINPAD_FIRMWARE
 	int bNumberMessage = 0; /* for GemPC Pinpad */
 	int gemalto_modify_pin_bug;
 #endif
 	uint32_t ulDataLength;
 
+	/* the pinpad may need its setup first. The first PIN command is
+	 * then slower: it also uploads the l10n strings */
+	(void)ccid_open_hack_deferred(reader_index);
+
 	pms = (PIN_MODIFY_STRUCTURE *)TxBuffer;
 	cmd[0] = 0x69;	/* Secure */
 	cmd[5] = ccid_descriptor->bCurrentSlotIndex;	/* slot number */
@@ -882,47 +894,412 @@ RESPONSECODE SecurePINModify(unsigned int reader_index,
 	/* We know the size of the CCID message now */
 	i2dw(a - 10, cmd + 1);	/* command length (includes bPINOperation) */
 
+	/* at least 90 seconds */
+	return SecurePINSend(reader_index, cmd, a, max(90, TxBuffer[0]+10)*1000,
+		RxBuffer, RxLength, pin);
+} /* SecurePINModifyCommand */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINSend
+ *
+ ****************************************************************************/
+static RESPONSECODE SecurePINSend(unsigned int reader_index,
+	unsigned char cmd[], unsigned int length, unsigned int timeout,
+	unsigned char RxBuffer[], unsigned int *RxLength, struct secure_pin *pin)
+{
+	status_t res;
+	int bSeq = cmd[6];
+
+	res = WritePort(reader_index, length, cmd);
+	if (STATUS_SUCCESS != res)
+	{
+		if (STATUS_NO_SUCH_DEVICE == res)
+			return IFD_NO_SUCH_DEVICE;
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	if (NULL == pin)
+		return SecurePINReceive(reader_index, 0x00 == cmd[10], bSeq, timeout,
+			RxBuffer, RxLength);
+
+	/* the response is received by SecurePINProc() */
+	pin->verify = (0x00 == cmd[10]);	/* bPINOperation */
+	pin->bSeq = bSeq;
+	pin->timeout = timeout;
+	if (0 == pthread_create(&pin->thread, NULL, SecurePINProc, pin))
+		pin->threaded = true;
+	else
+	{
+		/* the command is already sent. Wait for the response here */
+		DEBUG_CRITICAL("pthread_create failed");
+		(void)SecurePINProc(pin);
+	}
+
+	return IFD_SUCCESS;
+} /* SecurePINSend */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINReceive
+ *
+ ****************************************************************************/
+static RESPONSECODE SecurePINReceive(unsigned int reader_index, bool verify,
+	int bSeq, unsigned int timeout, unsigned char RxBuffer[],
+	unsigned int *RxLength)
+{
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+	int old_read_timeout;
+	RESPONSECODE ret;
+
 	old_read_timeout = ccid_descriptor -> readTimeout;
-	ccid_descriptor -> readTimeout = max(90, TxBuffer[0]+10)*1000;	/* at least 90 seconds */
+	ccid_descriptor -> readTimeout = timeout;
+
+	/* the user is typing: no adaptive timeout */
+	ret = CCID_ReceiveSeq(reader_index, RxLength, RxBuffer, NULL, bSeq, false);
+
+	/* T=1 Protocol Management for a TPDU reader */
+	if ((SCARD_PROTOCOL_T1 == ccid_descriptor->cardProtocol)
+		&& (CCID_CLASS_TPDU == (ccid_descriptor->dwFeatures & CCID_CLASS_EXCHANGE_MASK)))
+	{
+		/* timeout and cancel cases are faked by CCID_Receive() */
+		if ((2 == *RxLength)
+			/* the CCID command is rejected or failed */
+		   || (IFD_SUCCESS != ret))
+		{
+			/* Decrement the sequence numbers since no TPDU was sent */
+			get_ccid_slot(reader_index)->t1.ns ^= 1;
+			get_ccid_slot(reader_index)->t1.nr ^= 1;
+		}
+		else
+		{
+			/* FIXME: manage T=1 error blocks */
+
+			/* defines from openct/proto-t1.c */
+			#define PCB 1
+			#define DATA 3
+			#define T1_S_BLOCK		0xC0
+			#define T1_S_RESPONSE		0x20
+			#define T1_S_TYPE(pcb)		((pcb) & 0x0F)
+			#define T1_S_WTX		0x03
+
+			/* WTX S-block, only managed for a PIN verification */
+			if (verify && ((T1_S_BLOCK | T1_S_WTX) == RxBuffer[PCB]))
+			{
+/*
+ * The Swiss health care card sends a WTX request before returning the
+ * SW code. If the reader is in TPDU the driver must manage the request
+ * itself.
+ *
+ * received: 00 C3 01 09 CB
+ * openct/proto-t1.c:432:t1_transceive() S-Block request received
+ * openct/proto-t1.c:489:t1_transceive() CT sent S-block with wtx=9
+ * sending: 00 E3 01 09 EB
+ * openct/proto-t1.c:667:t1_xcv() New timeout at WTX request: 23643 sec
+ * received: 00 40 02 90 00 D2
+*/
+				ct_buf_t tbuf;
+				unsigned char sblk[1]; /* we only need 1 byte of data */
+				t1_state_t *t1 = &get_ccid_slot(reader_index)->t1;
+				unsigned int slen;
+				int oldReadTimeout;
+
+				DEBUG_COMM2("CT sent S-block with wtx=%u", RxBuffer[DATA]);
+				t1->wtx = RxBuffer[DATA];
+
+				oldReadTimeout = ccid_descriptor->readTimeout;
+				if (t1->wtx > 1)
+				{
+					/* set the new temporary timeout at WTX card request */
+					ccid_descriptor->readTimeout *= t1->wtx;
+					DEBUG_INFO2("New timeout at WTX request: %d sec",
+							ccid_descriptor->readTimeout);
+				}
+
+				ct_buf_init(&tbuf, sblk, sizeof(sblk));
+				t1->wtx = RxBuffer[DATA];
+				ct_buf_putc(&tbuf, RxBuffer[DATA]);
+
+				slen = t1_build(t1, RxBuffer, 0,
+					T1_S_BLOCK | T1_S_RESPONSE | T1_S_TYPE(RxBuffer[PCB]),
+					&tbuf, NULL);
+
+				ret = CCID_Transmit(t1 -> lun, slen, RxBuffer, 0, t1->wtx);
+				if (ret != IFD_SUCCESS)
+					goto end;
+
+				/* I guess we have at least 6 bytes in RxBuffer.
+				 * The card asked for more time: no adaptive timeout */
+				*RxLength = 6;
+				ret = CCID_ReceiveSeq(reader_index, RxLength, RxBuffer, NULL,
+					ccid_descriptor->xfrSeq, false);
+				if (ret != IFD_SUCCESS)
+					goto end;
+
+				/* Restore initial timeout */
+				ccid_descriptor->readTimeout = oldReadTimeout;
+			}
+
+			/* get only the T=1 data */
+			memmove(RxBuffer, RxBuffer+3, *RxLength -4);
+			*RxLength -= 4;	/* remove NAD, PCB, LEN and CRC */
+		}
+	}
+
+end:
+	ccid_descriptor -> readTimeout = old_read_timeout;
+	return ret;
+} /* SecurePINReceive */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINProc
+ *
+ ****************************************************************************/
+static void *SecurePINProc(void *p_pin)
+{
+	struct secure_pin *pin = p_pin;
+	unsigned int length = sizeof pin->buffer;
+	RESPONSECODE ret;
+
+	ret = SecurePINReceive(pin->reader_index, pin->verify, pin->bSeq,
+		pin->timeout, pin->buffer, &length);
+	DEBUG_INFO3("PIN operation done on reader %d: %ld", pin->reader_index,
+		(long)ret);
+
+	pthread_mutex_lock(&pin->mutex);
+	pin->ret = ret;
+	pin->length = length;
+	pin->done = true;
+	pthread_cond_broadcast(&pin->condition);
+	pthread_mutex_unlock(&pin->mutex);
+
+	return NULL;
+} /* SecurePINProc */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINStart
+ *
+ ****************************************************************************/
+RESPONSECODE SecurePINStart(unsigned int reader_index, bool verify,
+	unsigned char TxBuffer[], unsigned int TxLength)
+{
+	CcidDesc *ccid_slot = get_ccid_slot(reader_index);
+	struct secure_pin *pin;
+	RESPONSECODE ret;
+
+	if (ccid_slot->secure_pin)
+	{
+		DEBUG_CRITICAL("PIN operation already started");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	pin = calloc(1, sizeof *pin);
+	if (NULL == pin)
+	{
+		DEBUG_CRITICAL("calloc failed");
+		return IFD_COMMUNICATION_ERROR;
+	}
+	pin->reader_index = reader_index;
+	pthread_mutex_init(&pin->mutex, NULL);
+	pthread_cond_init(&pin->condition, NULL);
+
+	if (verify)
+		ret = SecurePINVerifyCommand(reader_index, TxBuffer, TxLength,
+			NULL, NULL, pin);
+	else
+		ret = SecurePINModifyCommand(reader_index, TxBuffer, TxLength,
+			NULL, NULL, pin);
+
+	if (IFD_SUCCESS != ret)
+	{
+		pthread_mutex_destroy(&pin->mutex);
+		pthread_cond_destroy(&pin->condition);
+		free(pin);
+		return ret;
+	}
+
+	ccid_slot->secure_pin = pin;
+
+	return IFD_SUCCESS;
+} /* SecurePINStart */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINFinish
+ *
+ ****************************************************************************/
+RESPONSECODE SecurePINFinish(unsigned int reader_index,
+	unsigned char RxBuffer[], unsigned int *RxLength)
+{
+	struct secure_pin *pin = get_ccid_slot(reader_index)->secure_pin;
+	RESPONSECODE ret;
+
+	if (NULL == pin)
+	{
+		DEBUG_CRITICAL("No PIN operation started");
+		*RxLength = 0;
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	/* wait until the end of the PIN entry */
+	SecurePINRelease(reader_index);
+
+	ret = pin->ret;
+	if (IFD_SUCCESS != ret)
+		*RxLength = 0;
+	else
+		if (pin->length > *RxLength)
+		{
+			*RxLength = 0;
+			ret = IFD_ERROR_INSUFFICIENT_BUFFER;
+		}
+		else
+		{
+			*RxLength = pin->length;
+			memcpy(RxBuffer, pin->buffer, pin->length);
+		}
+
+	free(pin);
+
+	return ret;
+} /* SecurePINFinish */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINKeyPressed
+ *
+ ****************************************************************************/
+RESPONSECODE SecurePINKeyPressed(unsigned int reader_index,
+	unsigned char *key)
+{
+	struct secure_pin *pin = get_ccid_slot(reader_index)->secure_pin;
+
+	if (NULL == pin)
+	{
+		DEBUG_CRITICAL("No PIN operation started");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	/* CCID does not report the individual key presses. Only the end of
+	 * the PIN entry is known */
+	pthread_mutex_lock(&pin->mutex);
+	if (! pin->done)
+		*key = 0x00;	/* no key pressed yet */
+	else
+		if ((IFD_SUCCESS == pin->ret) && (2 == pin->length)
+			&& (0x64 == pin->buffer[0]) && (0x01 == pin->buffer[1]))
+			*key = 0x1B;	/* cancel */
+		else
+			if ((IFD_SUCCESS == pin->ret) && (2 == pin->length)
+				&& (0x64 == pin->buffer[0]) && (0x00 == pin->buffer[1]))
+				*key = 0x40;	/* timeout */
+			else
+				*key = 0x0D;	/* validation: call SecurePINFinish() */
+	pthread_mutex_unlock(&pin->mutex);
+
+	return IFD_SUCCESS;
+} /* SecurePINKeyPressed */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINAbort
+ *
+ ****************************************************************************/
+RESPONSECODE SecurePINAbort(unsigned int reader_index)
+{
+	struct secure_pin *pin = get_ccid_slot(reader_index)->secure_pin;
+	/* the response to the aborted PC_to_RDR_Secure is read by
+	 * SecurePINProc(). Only the RDR_to_PC_SlotStatus is left */
+	unsigned char cmd[CCID_RESPONSE_HEADER_SIZE];
+	RESPONSECODE ret;
+	int bSeq;
+
+	if (! SecurePINBusy(reader_index))
+		return IFD_SUCCESS;
+
+	DEBUG_INFO2("Abort the PIN operation on reader %d", reader_index);
+
+	ret = CmdAbortRequest(reader_index, &bSeq);
+	if (IFD_SUCCESS != ret)
+		return ret;
+
+	/* the reader answers the aborted PC_to_RDR_Secure first */
+	pthread_mutex_lock(&pin->mutex);
+	while (! pin->done)
+		pthread_cond_wait(&pin->condition, &pin->mutex);
+	pthread_mutex_unlock(&pin->mutex);
+
+	return CmdAbortResponse(reader_index, bSeq, cmd, sizeof(cmd));
+} /* SecurePINAbort */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINBusy
+ *
+ ****************************************************************************/
+bool SecurePINBusy(unsigned int reader_index)
+{
+	struct secure_pin *pin = get_ccid_slot(reader_index)->secure_pin;
+	bool busy;
+
+	if (NULL == pin)
+		return false;
+
+	pthread_mutex_lock(&pin->mutex);
+	busy = ! pin->done;
+	pthread_mutex_unlock(&pin->mutex);
+
+	return busy;
+} /* SecurePINBusy */
+
+
+/*****************************************************************************
+ *
+ *					SecurePINCancel
+ *
+ ****************************************************************************/
+void SecurePINCancel(unsigned int reader_index)
+{
+	struct secure_pin *pin = get_ccid_slot(reader_index)->secure_pin;
+
+	if (NULL == pin)
+		return;
+
+	DEBUG_INFO2("Cancel the PIN operation on reader %d", reader_index);
+
+	(void)SecurePINAbort(reader_index);
+	SecurePINRelease(reader_index);
+	free(pin);
+} /* SecurePINCancel */
 
-	res = WritePort(reader_index, a, cmd);
-	if (STATUS_SUCCESS != res)
-	{
-		if (STATUS_NO_SUCH_DEVICE == res)
-			ret = IFD_NO_SUCH_DEVICE;
-		else
-			ret = IFD_COMMUNICATION_ERROR;
-		goto end;
-	}
 
-	ret = CCID_Receive(reader_index, RxLength, RxBuffer, NULL);
+/*****************************************************************************
+ *
+ *					SecurePINRelease
+ *
+ ****************************************************************************/
+static void SecurePINRelease(unsigned int reader_index)
+{
+	CcidDesc *ccid_slot = get_ccid_slot(reader_index);
+	struct secure_pin *pin = ccid_slot->secure_pin;
 
-	/* T=1 Protocol Management for a TPDU reader */
-	if ((SCARD_PROTOCOL_T1 == ccid_descriptor->cardProtocol)
-		&& (CCID_CLASS_TPDU == (ccid_descriptor->dwFeatures & CCID_CLASS_EXCHANGE_MASK)))
-	{
-		/* timeout and cancel cases are faked by CCID_Receive() */
-		if ((2 == *RxLength)
-			/* the CCID command is rejected or failed */
-			|| (IFD_SUCCESS != ret))
-		{
-			/* Decrement the sequence numbers since no TPDU was sent */
-			get_ccid_slot(reader_index)->t1.ns ^= 1;
-			get_ccid_slot(reader_index)->t1.nr ^= 1;
-		}
-		else
-		{
-			/* get only the T=1 data */
-			/* FIXME: manage T=1 error blocks */
-			memmove(RxBuffer, RxBuffer+3, *RxLength -4);
-			*RxLength -= 4;	/* remove NAD, PCB, LEN and CRC */
-		}
-	}
+	if (pin->threaded)
+		pthread_join(pin->thread, NULL);
 
-end:
-	ccid_descriptor -> readTimeout = old_read_timeout;
-	return ret;
-} /* SecurePINModify */
+	pthread_mutex_destroy(&pin->mutex);
+	pthread_cond_destroy(&pin->condition);
+	ccid_slot->secure_pin = NULL;
+} /* SecurePINRelease */
 
 
 /*****************************************************************************
@@ -1014,6 +1391,7 @@ time_request:
 	if (STATUS_COMM_NAK == res)
 	{
 		free(cmd_out);
+		Counters[reader_index].retries++;
 		goto again;
 	}
 
@@ -1038,15 +1416,18 @@ time_request:
 	if (cmd_out[STATUS_OFFSET] & CCID_TIME_EXTENSION)
 	{
 		DEBUG_COMM2("Time extension requested: 0x%02X", cmd_out[ERROR_OFFSET]);
+		Counters[reader_index].time_extensions++;
 		goto time_request;
 	}
 
 	if (cmd_out[STATUS_OFFSET] & CCID_COMMAND_FAILED)
 	{
-		/* mayfail: the error may be expected and not fatal */
+		/* mayfail: the error may be expected and not fatal. The caller
+		 * can tell a refusal by the reader from a transport error */
 		ccid_error(mayfail ? PCSC_LOG_INFO : PCSC_LOG_ERROR,
 			cmd_out[ERROR_OFFSET], __FILE__, __LINE__, __FUNCTION__);	/* bError */
-		return_value = IFD_COMMUNICATION_ERROR;
+		return_value = mayfail ? IFD_ERROR_NOT_SUPPORTED
+			: IFD_COMMUNICATION_ERROR;
 	}
 
 	/* copy the response */
@@ -1160,6 +1541,142 @@ RESPONSECODE CmdPowerOff(unsigned int reader_index)
 } /* CmdPowerOff */
 
 
+/*****************************************************************************
+ *
+ *					CmdAbort
+ *
+ ****************************************************************************/
+RESPONSECODE CmdAbort(unsigned int reader_index)
+{
+	/* a late response is read in chunks. A multiple of the USB packet
+	 * size and more than a serial frame */
+	unsigned char cmd[1024];
+	RESPONSECODE ret;
+	int bSeq;
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+
+	/* do not wait for an answer that does not come */
+	if (ccid_descriptor->bAbortFailed)
+		return IFD_NOT_SUPPORTED;
+
+	ret = CmdAbortRequest(reader_index, &bSeq);
+	if (IFD_SUCCESS == ret)
+		ret = CmdAbortResponse(reader_index, bSeq, cmd, sizeof(cmd));
+
+	if ((IFD_SUCCESS != ret) && (IFD_NO_SUCH_DEVICE != ret))
+	{
+		DEBUG_INFO1("Abort failed. Not used anymore for this reader");
+		ccid_descriptor->bAbortFailed = true;
+	}
+
+	return ret;
+} /* CmdAbort */
+
+
+/*****************************************************************************
+ *
+ *					CmdAbortRequest
+ *
+ ****************************************************************************/
+static RESPONSECODE CmdAbortRequest(unsigned int reader_index, int *pbSeq)
+{
+	unsigned char cmd[10];
+	int bSeq;
+	status_t res;
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+
+	bSeq = (*ccid_descriptor->pbSeq)++;
+	*pbSeq = bSeq;
+
+	DEBUG_INFO3("Abort slot %d, bSeq %d", ccid_descriptor->bCurrentSlotIndex,
+		bSeq);
+
+#ifndef TWIN_SERIAL
+	{
+		int r;
+
+		/* class specific ABORT request, wValue: bSeq and bSlot */
+		r = ControlUSB(reader_index, 0x21, 0x01,
+			(bSeq << 8) | ccid_descriptor->bCurrentSlotIndex, NULL, 0);
+
+		/* we got an error? */
+		if (r < 0)
+		{
+			DEBUG_INFO2("ABORT failed: %s", strerror(errno));
+			if (ENODEV == errno)
+				return IFD_NO_SUCH_DEVICE;
+			return IFD_COMMUNICATION_ERROR;
+		}
+	}
+#endif
+
+	cmd[0] = 0x72; /* Abort */
+	cmd[1] = cmd[2] = cmd[3] = cmd[4] = 0;	/* dwLength */
+	cmd[5] = ccid_descriptor->bCurrentSlotIndex;	/* slot number */
+	cmd[6] = bSeq;
+	cmd[7] = cmd[8] = cmd[9] = 0; /* RFU */
+
+	res = WritePort(reader_index, sizeof(cmd), cmd);
+	CHECK_STATUS(res)
+
+	return IFD_SUCCESS;
+} /* CmdAbortRequest */
+
+
+/*****************************************************************************
+ *
+ *					CmdAbortResponse
+ *
+ ****************************************************************************/
+static RESPONSECODE CmdAbortResponse(unsigned int reader_index, int bSeq,
+	unsigned char cmd[], unsigned int size)
+{
+	status_t res;
+	unsigned int length, old_timeout;
+	int frames = 0;
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+
+	/* The reader answers at once, do not wait for the card timeout */
+	old_timeout = ccid_descriptor->readTimeout;
+	ccid_descriptor->readTimeout = DEFAULT_COM_READ_TIMEOUT;
+
+read_again:
+	/* the late response to the aborted command (if any) may contain
+	 * data and comes first. Skip it, chunk by chunk if it is bigger
+	 * than cmd[], until the RDR_to_PC_SlotStatus with the bSeq of the
+	 * abort. ReadSerial() does not check the bSeq */
+	length = size;
+	res = ReadPort(reader_index, &length, cmd, -1);
+	if ((STATUS_SUCCESS == res)
+		&& ((length < CCID_RESPONSE_HEADER_SIZE) || (0x81 != cmd[0])
+			|| (bSeq != cmd[6]) || (0 != dw2i(cmd, 1))))
+	{
+		DEBUG_INFO2("Skip %d bytes of a previous response", length);
+		if (++frames <= 10 + (10+CMD_BUF_SIZE) / (int)size)
+			goto read_again;
+
+		DEBUG_CRITICAL("No response to the abort");
+		res = STATUS_UNSUCCESSFUL;
+	}
+	ccid_descriptor->readTimeout = old_timeout;
+	CHECK_STATUS(res)
+
+	if (length < CCID_RESPONSE_HEADER_SIZE)
+	{
+		DEBUG_CRITICAL2("Not enough data received: %d bytes", length);
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	if (cmd[STATUS_OFFSET] & CCID_COMMAND_FAILED)
+	{
+		ccid_error(PCSC_LOG_ERROR, cmd[ERROR_OFFSET], __FILE__, __LINE__, __FUNCTION__);	/* bError */
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	return IFD_SUCCESS;
+} /* CmdAbortResponse */
+
+
 /*****************************************************************************
  *
  *					CmdGetSlotStatus
@@ -1179,6 +1696,7 @@ RESPONSECODE CmdGetSlotStatus(unsigned int reader_index, unsigned char buffer[])
 	{
 		int r;
 		unsigned char status[1];
+		unsigned int delay = 0, waited = 0;
 
 again_status:
 		/* SlotStatus */
@@ -1197,10 +1715,17 @@ again_status:
 		if (status[0] & 0x40)
 		{
 			DEBUG_INFO2("Busy: 0x%02X", status[0]);
-			(void)usleep(1000 * 10);
+
+			delay = ICCD_NextDelay(ccid_descriptor->iccdBusyTime, waited,
+				delay);
+			ICCD_A_Wait(reader_index, delay);
+			waited += delay;
 			goto again_status;
 		}
 
+		if (waited)
+			ICCD_LearnBusyTime(&ccid_descriptor->iccdBusyTime, waited, delay);
+
 		/* simulate a CCID bStatus */
 		/* present and active by default */
 		buffer[7] = CCID_ICC_PRESENT_ACTIVE;
@@ -1251,7 +1776,7 @@ again_status:
 #endif
 
 #ifdef __APPLE__
-	if (MICROCHIP_SEC1100 == ccid_descriptor->readerID)
+	if (ccid_descriptor->dwQuirks & QUIRK_INTERRUPT_BEFORE_STATUS)
 		InterruptRead(reader_index, 10);
 #endif
 
@@ -1289,61 +1814,100 @@ again_status:
 
 /*****************************************************************************
  *
- *					CmdXfrBlock
+ *					SetXfrBlock
  *
  ****************************************************************************/
-RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
-	unsigned char tx_buffer[], unsigned int *rx_length,
-	unsigned char rx_buffer[], int protocol)
+void SetXfrBlock(unsigned int reader_index)
 {
-	RESPONSECODE return_value = IFD_SUCCESS;
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+	XfrBlock_t *xfr = XfrBlock[reader_index];
 
 	/* APDU or TPDU? */
 	switch (ccid_descriptor->dwFeatures & CCID_CLASS_EXCHANGE_MASK)
 	{
 		case CCID_CLASS_TPDU:
-			if (protocol == T_0)
-				return_value = CmdXfrBlockTPDU_T0(reader_index,
-					tx_length, tx_buffer, rx_length, rx_buffer);
-			else
-				if (protocol == T_1)
-					return_value = CmdXfrBlockTPDU_T1(reader_index, tx_length,
-						tx_buffer, rx_length, rx_buffer);
-				else
-					return_value = IFD_PROTOCOL_NOT_SUPPORTED;
+			xfr[T_0] = CmdXfrBlockTPDU_T0;
+			xfr[T_1] = CmdXfrBlockTPDU_T1;
+			xfr[XFR_PROTOCOL_OTHER] = CmdXfrBlockNotSupported;
 			break;
 
 		case CCID_CLASS_SHORT_APDU:
-			return_value = CmdXfrBlockTPDU_T0(reader_index,
-				tx_length, tx_buffer, rx_length, rx_buffer);
+			xfr[T_0] = xfr[T_1] = xfr[XFR_PROTOCOL_OTHER] = CmdXfrBlockTPDU_T0;
 			break;
 
 		case CCID_CLASS_EXTENDED_APDU:
-			return_value = CmdXfrBlockAPDU_extended(reader_index,
-				tx_length, tx_buffer, rx_length, rx_buffer);
+			xfr[T_0] = xfr[T_1] = xfr[XFR_PROTOCOL_OTHER] =
+				CmdXfrBlockAPDU_extended;
 			break;
 
 		case CCID_CLASS_CHARACTER:
-			if (protocol == T_0)
-				return_value = CmdXfrBlockCHAR_T0(reader_index, tx_length,
-					tx_buffer, rx_length, rx_buffer);
-			else
-				if (protocol == T_1)
-					return_value = CmdXfrBlockTPDU_T1(reader_index, tx_length,
-						tx_buffer, rx_length, rx_buffer);
-				else
-					return_value = IFD_PROTOCOL_NOT_SUPPORTED;
+			xfr[T_0] = CmdXfrBlockCHAR_T0;
+			xfr[T_1] = CmdXfrBlockTPDU_T1;
+			xfr[XFR_PROTOCOL_OTHER] = CmdXfrBlockNotSupported;
 			break;
 
 		default:
-			return_value = IFD_COMMUNICATION_ERROR;
+			xfr[T_0] = xfr[T_1] = xfr[XFR_PROTOCOL_OTHER] = CmdXfrBlockUnknown;
 	}
+} /* SetXfrBlock */
 
-	return return_value;
+
+/*****************************************************************************
+ *
+ *					CmdXfrBlock
+ *
+ ****************************************************************************/
+RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
+	unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[], int protocol)
+{
+	if ((protocol != T_0) && (protocol != T_1))
+		protocol = XFR_PROTOCOL_OTHER;
+
+	return XfrBlock[reader_index][protocol](reader_index, tx_length,
+		tx_buffer, rx_length, rx_buffer);
 } /* CmdXfrBlock */
 
 
+/*****************************************************************************
+ *
+ *					CmdXfrBlockNotSupported
+ *
+ ****************************************************************************/
+static RESPONSECODE CmdXfrBlockNotSupported(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[])
+{
+	(void)reader_index;
+	(void)tx_length;
+	(void)tx_buffer;
+	(void)rx_length;
+	(void)rx_buffer;
+
+	return IFD_PROTOCOL_NOT_SUPPORTED;
+} /* CmdXfrBlockNotSupported */
+
+
+/*****************************************************************************
+ *
+ *					CmdXfrBlockUnknown
+ *
+ ****************************************************************************/
+static RESPONSECODE CmdXfrBlockUnknown(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[], unsigned int *rx_length,
+	unsigned char rx_buffer[])
+{
+	(void)reader_index;
+	(void)tx_length;
+	(void)tx_buffer;
+	(void)rx_length;
+	(void)rx_buffer;
+
+	/* unknown exchange level */
+	return IFD_COMMUNICATION_ERROR;
+} /* CmdXfrBlockUnknown */
+
+
 /*****************************************************************************
  *
  *					CCID_Transmit
@@ -1383,6 +1947,11 @@ RESPONSECODE CCID_Transmit(unsigned int reader_index, unsigned int tx_length,
 		if (NULL == tx_buffer)
 			rx_length = 0x10;	/* bLevelParameter */
 
+		/* first block of an APDU: remember the INS to learn its
+		 * processing time */
+		if (tx_buffer && (tx_length >= 2) && (rx_length <= 0x01))
+			ccid_descriptor->iccdIns = tx_buffer[1];
+
 		/* Xfr Block */
 		DEBUG_COMM2("chain parameter: %d", rx_length);
 		r = ControlUSB(reader_index, 0x21, 0x65, rx_length << 8,
@@ -1403,6 +1972,7 @@ RESPONSECODE CCID_Transmit(unsigned int reader_index, unsigned int tx_length,
 	i2dw(tx_length, cmd+1);	/* APDU length */
 	cmd[5] = ccid_descriptor->bCurrentSlotIndex;	/* slot number */
 	cmd[6] = (*ccid_descriptor->pbSeq)++;
+	ccid_descriptor->xfrSeq = cmd[6];
 	cmd[7] = bBWI;	/* extend block waiting timeout */
 	cmd[8] = rx_length & 0xFF;	/* Expected length, in character mode only */
 	cmd[9] = (rx_length >> 8) & 0xFF;
@@ -1410,6 +1980,9 @@ RESPONSECODE CCID_Transmit(unsigned int reader_index, unsigned int tx_length,
 	if (tx_buffer)
 		memcpy(cmd+10, tx_buffer, tx_length);
 
+	if (DriverOptions & DRIVER_OPTION_ADAPTIVE_TIMEOUT)
+		ccid_descriptor->xfrStart = get_time_us();
+
 	ret = WritePort(reader_index, 10+tx_length, cmd);
 	CHECK_STATUS(ret)
 
@@ -1424,13 +1997,33 @@ RESPONSECODE CCID_Transmit(unsigned int reader_index, unsigned int tx_length,
  ****************************************************************************/
 RESPONSECODE CCID_Receive(unsigned int reader_index, unsigned int *rx_length,
 	unsigned char rx_buffer[], unsigned char *chain_parameter)
+{
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+
+	/* bSeq of the command sent by CCID_Transmit() for this slot. The
+	 * other slots of the reader may have sent a command since */
+	return CCID_ReceiveSeq(reader_index, rx_length, rx_buffer,
+		chain_parameter, ccid_descriptor->xfrSeq, true);
+} /* CCID_Receive */
+
+
+/*****************************************************************************
+ *
+ *					CCID_ReceiveSeq
+ *
+ ****************************************************************************/
+static RESPONSECODE CCID_ReceiveSeq(unsigned int reader_index,
+	unsigned int *rx_length, unsigned char rx_buffer[],
+	unsigned char *chain_parameter, int bSeq, bool adaptive)
 {
 	unsigned char cmd[10+CMD_BUF_SIZE];	/* CCID + APDU buffer */
 	unsigned int length;
 	RESPONSECODE return_value = IFD_SUCCESS;
 	status_t ret;
 	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
-	unsigned int old_timeout;
+	unsigned int old_timeout, deadline;
+	bool aborted = false;
+	uint64_t start;
 
 #ifndef TWIN_SERIAL
 	if (PROTOCOL_ICCD_A == ccid_descriptor->bInterfaceProtocol)
@@ -1465,6 +2058,14 @@ RESPONSECODE CCID_Receive(unsigned int reader_index, unsigned int *rx_length,
 		unsigned char rx_tmp[4];
 		unsigned char *old_rx_buffer = NULL;
 		int old_rx_length = 0;
+		unsigned int *learned;
+		unsigned int delay = 0, waited = 0;
+
+		/* busy time learned for this INS, or for the device if the INS
+		 * has not been seen yet */
+		learned = &ccid_descriptor->iccdBusyTimeIns[ccid_descriptor->iccdIns];
+		if (0 == *learned)
+			*learned = ccid_descriptor->iccdBusyTime;
 
 		/* read a nul block. buffer need to be at least 4-bytes */
 		if (NULL == rx_buffer)
@@ -1516,15 +2117,19 @@ time_request_ICCD_B:
 			case 0x80:
 				/* Polling */
 			{
-				int delay;
+				int wDelay;
 
-				delay = (rx_buffer[2] << 8) + rx_buffer[1];
-				DEBUG_COMM2("Pooling delay: %d", delay);
+				wDelay = (rx_buffer[2] << 8) + rx_buffer[1];
+				DEBUG_COMM2("Pooling delay: %d", wDelay);
 
-				if (0 == delay)
+				if (0 == wDelay)
 					/* host select the delay */
-					delay = 1;
-				(void)usleep(delay * 1000 * 10);
+					delay = ICCD_NextDelay(*learned, waited, delay);
+				else
+					/* delay requested by the device, in 10 ms units */
+					delay = wDelay * 1000 * 10;
+				(void)usleep(delay);
+				waited += delay;
 				goto time_request_ICCD_B;
 			}
 
@@ -1543,6 +2148,12 @@ time_request_ICCD_B:
 				return IFD_COMMUNICATION_ERROR;
 		}
 
+		if (waited)
+		{
+			ICCD_LearnBusyTime(learned, waited, delay);
+			ccid_descriptor->iccdBusyTime = *learned;
+		}
+
 		memmove(rx_buffer, rx_buffer+1, r-1);
 		*rx_length = r-1;
 
@@ -1553,12 +2164,54 @@ time_request_ICCD_B:
 	/* store the original value of read timeout*/
 	old_timeout = ccid_descriptor -> readTimeout;
 
+	/* start time of the command sent by CCID_Transmit(). It is used
+	 * once so a command sent by another function is not measured */
+	start = ccid_descriptor->xfrStart;
+	ccid_descriptor->xfrStart = 0;
+	if (0 == start)
+		adaptive = false;
+
+	/* first wait for the usual response time only */
+	deadline = adaptive ? adaptive_timeout(ccid_descriptor) : 0;
+	if (deadline)
+		ccid_descriptor -> readTimeout = deadline;
+
 time_request:
+	/* a late response to a previous command has a different bSeq and
+	 * is discarded */
 	length = sizeof(cmd);
-	ret = ReadPort(reader_index, &length, cmd, -1);
+	ret = ReadPort(reader_index, &length, cmd, bSeq);
+
+	/* no response in the usual time */
+	if (deadline && (STATUS_SUCCESS != ret) && (STATUS_NO_SUCH_DEVICE != ret))
+	{
+		RESPONSECODE abort_ret;
+
+		DEBUG_INFO2("No response after %d ms, abort", deadline);
+		deadline = 0;
+		aborted = true;
+
+		abort_ret = CmdAbort(reader_index);
+		ccid_descriptor -> readTimeout = old_timeout;
+		if (IFD_SUCCESS == abort_ret)
+			return IFD_COMMUNICATION_ERROR;
+
+		/* the reader does not answer the abort: wait for the response
+		 * to the command until the timeout computed from the ATR */
+		DEBUG_INFO1("Abort failed, wait for the response");
+		length = sizeof(cmd);
+		ret = ReadPort(reader_index, &length, cmd, bSeq);
+	}
 
 	/* restore the original value of read timeout */
 	ccid_descriptor -> readTimeout = old_timeout;
+
+	/* still no response: abort the command so the reader and the slot
+	 * are ready for the next command instead of sending the late
+	 * response to it */
+	if ((STATUS_SUCCESS != ret) && (STATUS_NO_SUCH_DEVICE != ret) && !aborted
+		&& (IFD_NO_SUCH_DEVICE == CmdAbort(reader_index)))
+		return IFD_NO_SUCH_DEVICE;
 	CHECK_STATUS(ret)
 
 	if (length < CCID_RESPONSE_HEADER_SIZE)
@@ -1605,6 +2258,10 @@ time_request:
 	if (cmd[STATUS_OFFSET] & CCID_TIME_EXTENSION)
 	{
 		DEBUG_COMM2("Time extension requested: 0x%02X", cmd[ERROR_OFFSET]);
+		Counters[reader_index].time_extensions++;
+
+		/* the card is alive but needs more time */
+		deadline = 0;
 
 		/* compute the new value of read timeout */
 		if (cmd[ERROR_OFFSET] > 0)
@@ -1647,8 +2304,12 @@ time_request:
 	if (chain_parameter)
 		*chain_parameter = cmd[CHAIN_PARAMETER_OFFSET];
 
+	if ((IFD_SUCCESS == return_value) && adaptive
+		&& (DriverOptions & DRIVER_OPTION_ADAPTIVE_TIMEOUT))
+		update_latency(ccid_descriptor, start);
+
 	return return_value;
-} /* CCID_Receive */
+} /* CCID_ReceiveSeq */
 
 
 /*****************************************************************************
@@ -2374,6 +3035,146 @@ int isCharLevel(int reader_index)
 } /* isCharLevel */
 
 
+#ifndef TWIN_SERIAL
+/*****************************************************************************
+ *
+ *					ICCD_NextDelay
+ *
+ ****************************************************************************/
+static unsigned int ICCD_NextDelay(unsigned int learned, unsigned int waited,
+	unsigned int delay)
+{
+	/* first wait: the busy time learned from the previous commands,
+	 * then exponential back off */
+	if (0 == waited)
+		delay = learned;
+	else if (waited == delay)
+		delay = ICCD_POLL_MIN_DELAY;
+	else
+		delay *= 2;
+
+	if (delay < ICCD_POLL_MIN_DELAY)
+		delay = ICCD_POLL_MIN_DELAY;
+	if (delay > ICCD_POLL_MAX_DELAY)
+		delay = ICCD_POLL_MAX_DELAY;
+
+	return delay;
+} /* ICCD_NextDelay */
+
+
+/*****************************************************************************
+ *
+ *					ICCD_LearnBusyTime
+ *
+ ****************************************************************************/
+static void ICCD_LearnBusyTime(unsigned int *learned, unsigned int waited,
+	unsigned int delay)
+{
+	/* ready after the first wait: try a shorter one next time.
+	 * Otherwise move towards the observed busy time */
+	if (waited == delay)
+		*learned = waited * 3 / 4;
+	else
+		*learned = (*learned + waited) / 2;
+
+	DEBUG_COMM3("Busy for %d us, next first wait: %d us", waited, *learned);
+} /* ICCD_LearnBusyTime */
+
+
+/*****************************************************************************
+ *
+ *					ICCD_A_Wait
+ *
+ ****************************************************************************/
+static void ICCD_A_Wait(unsigned int reader_index, unsigned int delay)
+{
+	_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
+
+	/* The interrupt end point (if any) is used to wake up as soon as the
+	 * device sends a notification instead of sleeping the whole delay.
+	 * The polling thread of pcscd does not use it for ICCD devices. */
+	if ((ccid_descriptor->bNumEndpoints > 0) && (delay >= 1000))
+	{
+		if (IFD_SUCCESS == InterruptRead(reader_index, delay / 1000))
+			return;
+
+		DEBUG_INFO1("InterruptRead failed, fall back to polling");
+	}
+
+	(void)usleep(delay);
+} /* ICCD_A_Wait */
+#endif
+
+
+/*****************************************************************************
+ *
+ *					adaptive_timeout
+ *
+ ****************************************************************************/
+static unsigned int adaptive_timeout(_ccid_descriptor *ccid_descriptor)
+{
+	unsigned int timeout;
+
+	if (! (DriverOptions & DRIVER_OPTION_ADAPTIVE_TIMEOUT))
+		return 0;
+
+	/* the short deadline needs a working abort */
+	if (ccid_descriptor->bAbortFailed)
+		return 0;
+
+	/* not enough responses measured yet */
+	if (ccid_descriptor->xfrLatencySamples < ADAPTIVE_TIMEOUT_SAMPLES)
+		return 0;
+
+	/* same margin as the TCP retransmission timeout (RFC 6298) */
+	timeout = (ccid_descriptor->xfrLatency
+		+ 4 * ccid_descriptor->xfrLatencyDeviation) / 1000;
+	if (timeout < ADAPTIVE_TIMEOUT_MIN)
+		timeout = ADAPTIVE_TIMEOUT_MIN;
+
+	/* not shorter than the timeout computed from the ATR */
+	if (timeout >= ccid_descriptor->readTimeout)
+		return 0;
+
+	return timeout;
+} /* adaptive_timeout */
+
+
+/*****************************************************************************
+ *
+ *					update_latency
+ *
+ ****************************************************************************/
+static void update_latency(_ccid_descriptor *ccid_descriptor,
+	uint64_t start)
+{
+	unsigned int latency, diff;
+
+	latency = get_time_us() - start;
+
+	if (0 == ccid_descriptor->xfrLatencySamples)
+	{
+		ccid_descriptor->xfrLatency = latency;
+		ccid_descriptor->xfrLatencyDeviation = latency / 2;
+	}
+	else
+	{
+		if (latency > ccid_descriptor->xfrLatency)
+			diff = latency - ccid_descriptor->xfrLatency;
+		else
+			diff = ccid_descriptor->xfrLatency - latency;
+
+		ccid_descriptor->xfrLatencyDeviation =
+			(3 * ccid_descriptor->xfrLatencyDeviation + diff) / 4;
+		ccid_descriptor->xfrLatency =
+			(7 * ccid_descriptor->xfrLatency + latency) / 8;
+	}
+
+	if (ccid_descriptor->xfrLatencySamples < ADAPTIVE_TIMEOUT_SAMPLES)
+		ccid_descriptor->xfrLatencySamples++;
+} /* update_latency */
+
+
 /*****************************************************************************
  *
  *					i2dw
@@ -34,6 +34,21 @@ RESPONSECODE SecurePINModify(unsigned int reader_index,
 	unsigned char TxBuffer[], unsigned int TxLength,
 	unsigned char RxBuffer[], unsigned int *RxLength);
 
+RESPONSECODE SecurePINStart(unsigned int reader_index, bool verify,
+	unsigned char TxBuffer[], unsigned int TxLength);
+
+RESPONSECODE SecurePINFinish(unsigned int reader_index,
+	unsigned char RxBuffer[], unsigned int *RxLength);
+
+RESPONSECODE SecurePINKeyPressed(unsigned int reader_index,
+	/*@out@*/ unsigned char *key);
+
+RESPONSECODE SecurePINAbort(unsigned int reader_index);
+
+bool SecurePINBusy(unsigned int reader_index);
+
+void SecurePINCancel(unsigned int reader_index);
+
 RESPONSECODE CmdEscape(unsigned int reader_index,
 	const unsigned char TxBuffer[], unsigned int TxLength,
 	unsigned char RxBuffer[], unsigned int *RxLength, unsigned int timeout);
@@ -45,9 +60,13 @@ RESPONSECODE CmdEscapeCheck(unsigned int reader_index,
 
 RESPONSECODE CmdPowerOff(unsigned int reader_index);
 
+RESPONSECODE CmdAbort(unsigned int reader_index);
+
 RESPONSECODE CmdGetSlotStatus(unsigned int reader_index,
 	/*@out@*/ unsigned char buffer[]);
 
+void SetXfrBlock(unsigned int reader_index);
+
 RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 	unsigned char tx_buffer[], unsigned int *rx_length,
 	unsigned char rx_buffer[], int protoccol);
@@ -0,0 +1,237 @@
+/*
+    counters.c: per reader performance counters
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SHM_OPEN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "ccid.h"
+#include "defs.h"
+#include "ccid_ifdhandler.h"
+#include "debug.h"
+#include "utils.h"
+#include "counters.h"
+
+struct counters_shm
+{
+	struct ccid_counters_header header;
+	struct ccid_counters reader[CCID_DRIVER_MAX_READERS];
+};
+
+/* used if the counters are not published */
+static struct ccid_counters LocalCounters[CCID_DRIVER_MAX_READERS];
+
+struct ccid_counters *Counters = LocalCounters;
+
+#ifdef HAVE_SHM_OPEN
+/* name of the published object, removed when the driver is unloaded */
+static char ShmName[sizeof COUNTERS_SHM_NAME + 12];
+
+static void counters_exit(void) __attribute__((destructor));
+#endif
+
+
+/*****************************************************************************
+ *
+ *					counters_init
+ *
+ ****************************************************************************/
+void counters_init(void)
+{
+#ifdef HAVE_SHM_OPEN
+	struct counters_shm *shm;
+	char *name = ShmName;
+	struct stat st;
+	int fd;
+
+	if (! (DriverOptions & DRIVER_OPTION_SHM_COUNTERS))
+		return;
+
+	/* already done */
+	if (Counters != LocalCounters)
+		return;
+
+	(void)snprintf(name, sizeof ShmName, COUNTERS_SHM_NAME "%d", (int)getpid());
+
+	/* left by a previous process with the same pid */
+	(void)shm_unlink(name);
+
+	/* only the driver can write the counters. Never reuse an object
+	 * created by someone else */
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR
+		| S_IRGRP | S_IROTH);
+	if (-1 == fd)
+	{
+		DEBUG_CRITICAL3("shm_open %s: %s", name, strerror(errno));
+		return;
+	}
+
+	if (-1 == fstat(fd, &st))
+	{
+		DEBUG_CRITICAL3("fstat %s: %s", name, strerror(errno));
+		goto error;
+	}
+
+	if (st.st_uid != geteuid())
+	{
+		DEBUG_CRITICAL3("%s is owned by uid %d", name, (int)st.st_uid);
+		goto error;
+	}
+
+	if (-1 == ftruncate(fd, sizeof *shm))
+	{
+		DEBUG_CRITICAL3("ftruncate %s: %s", name, strerror(errno));
+		goto error;
+	}
+
+	shm = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == shm)
+	{
+		DEBUG_CRITICAL3("mmap %s: %s", name, strerror(errno));
+		goto error;
+	}
+	(void)close(fd);
+
+	/* the readers may already be counted */
+	memcpy(shm->reader, LocalCounters, sizeof LocalCounters);
+
+	shm->header.nb_readers = CCID_DRIVER_MAX_READERS;
+	shm->header.reader_size = sizeof(struct ccid_counters);
+	shm->header.version = COUNTERS_VERSION;
+	shm->header.magic = COUNTERS_MAGIC;
+
+	Counters = shm->reader;
+	DEBUG_INFO2("Counters published in %s", name);
+
+	return;
+
+error:
+	(void)close(fd);
+	(void)shm_unlink(name);
+#endif
+} /* counters_init */
+
+
+#ifdef HAVE_SHM_OPEN
+/*****************************************************************************
+ *
+ *					counters_exit
+ *
+ *	Called when pcscd exits or unloads the driver. The object of a
+ *	process killed before has to be removed by hand from /dev/shm/
+ *
+ ****************************************************************************/
+static void counters_exit(void)
+{
+	/* not published */
+	if (Counters == LocalCounters)
+		return;
+
+	/* the mapping stays valid until the process exits */
+	if (-1 == shm_unlink(ShmName))
+		DEBUG_CRITICAL3("shm_unlink %s: %s", ShmName, strerror(errno));
+} /* counters_exit */
+#endif
+
+
+/*****************************************************************************
+ *
+ *					counters_open
+ *
+ ****************************************************************************/
+void counters_open(unsigned int reader_index, unsigned int lun,
+	unsigned int readerID, unsigned int slot)
+{
+	struct ccid_counters *counters = &Counters[reader_index];
+
+	/* in_use is set last so a new entry is always seen cleared */
+	memset(counters, 0, sizeof *counters);
+	counters->lun = lun;
+	counters->readerID = readerID;
+	counters->slot = slot;
+	counters->in_use = 1;
+} /* counters_open */
+
+
+/*****************************************************************************
+ *
+ *					counters_close
+ *
+ ****************************************************************************/
+void counters_close(unsigned int reader_index)
+{
+	/* the values are kept until the entry is used again */
+	Counters[reader_index].in_use = 0;
+} /* counters_close */
+
+
+/*****************************************************************************
+ *
+ *					counters_latency
+ *
+ ****************************************************************************/
+void counters_latency(struct ccid_latency *latency, uint64_t start_us)
+{
+	uint64_t us = get_time_us() - start_us;
+	unsigned int msb, bucket;
+
+	if (us < 2)
+		bucket = us;
+	else
+	{
+		for (msb = 0; (us >> msb) > 1; msb++)
+			;
+
+		/* power of two and the next bit */
+		bucket = 2 * msb + ((us >> (msb - 1)) & 1);
+		if (bucket >= LATENCY_BUCKETS)
+			bucket = LATENCY_BUCKETS - 1;
+	}
+
+	latency->bucket[bucket]++;
+	latency->count++;
+	latency->sum_us += us;
+	if (us > latency->max_us)
+		latency->max_us = us > UINT32_MAX ? UINT32_MAX : us;
+} /* counters_latency */
+
+
+/*****************************************************************************
+ *
+ *					counters_latency_reset
+ *
+ ****************************************************************************/
+void counters_latency_reset(unsigned int reader_index)
+{
+	struct ccid_counters *counters = &Counters[reader_index];
+
+	memset(&counters->transmit_latency, 0, sizeof counters->transmit_latency);
+	memset(&counters->power_latency, 0, sizeof counters->power_latency);
+	memset(&counters->presence_latency, 0, sizeof counters->presence_latency);
+} /* counters_latency_reset */
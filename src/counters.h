@@ -0,0 +1,108 @@
+/*
+    counters.h: per reader performance counters
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <stdint.h>
+
+/*
+ * With DRIVER_OPTION_SHM_COUNTERS the counters are published in the
+ * POSIX shared memory object COUNTERS_SHM_NAME (followed by the pid of
+ * the process using the driver, i.e. pcscd) so that an external tool can
+ * read them. The object contains a struct ccid_counters_header followed
+ * by nb_readers struct ccid_counters of reader_size bytes each.
+ *
+ * The counters are updated without any lock. A reader must tolerate
+ * values being updated while it reads them.
+ */
+#ifdef TWIN_SERIAL
+#define COUNTERS_SHM_NAME "/libccidtwin."
+#else
+#define COUNTERS_SHM_NAME "/libccid."
+#endif
+
+#define COUNTERS_MAGIC 0x43434944	/* "CCID" */
+#define COUNTERS_VERSION 2
+
+struct ccid_counters_header
+{
+	uint32_t magic;	/* COUNTERS_MAGIC */
+	uint32_t version;	/* COUNTERS_VERSION */
+	uint32_t nb_readers;	/* number of struct ccid_counters */
+	uint32_t reader_size;	/* sizeof(struct ccid_counters) */
+};
+
+/*
+ * Latency histogram, in microseconds
+ *
+ * Each power of two is split in two buckets: bucket i (i >= 2) counts
+ * the samples from (2 + i % 2) << (i / 2 - 1) included to the lower
+ * bound of bucket i+1 excluded. Buckets 0 and 1 count the samples of 0
+ * and 1 microsecond. The last bucket also counts everything above
+ * 201 seconds.
+ *
+ * The same structure is returned as the value of the
+ * SCARD_ATTR_CCID_LATENCY_* attributes.
+ */
+#define LATENCY_BUCKETS 56
+
+struct ccid_latency
+{
+	uint32_t count;	/* number of samples */
+	uint32_t max_us;	/* slowest sample */
+	uint64_t sum_us;	/* sum of all the samples */
+	uint32_t bucket[LATENCY_BUCKETS];
+};
+
+/* one entry per reader_index, so per slot of a multi-slot reader */
+struct ccid_counters
+{
+	uint32_t in_use;	/* the entry is used by an opened reader */
+	uint32_t lun;	/* Lun given by pcscd */
+	uint32_t readerID;	/* (idVendor << 16) + idProduct */
+	uint32_t slot;	/* bCurrentSlotIndex */
+
+	uint64_t apdus;	/* IFDHTransmitToICC() calls */
+	uint64_t bytes_out;	/* bytes written, CCID headers included */
+	uint64_t bytes_in;	/* bytes read, CCID headers included */
+	uint64_t messages_out;	/* CCID messages written */
+	uint64_t messages_in;	/* CCID messages read */
+	uint64_t retries;	/* T=1 blocks and serial frames sent again */
+	uint64_t duplicate_frames;	/* frames read with a wrong bSeq */
+	uint64_t t1_resyncs;	/* T=1 S(RESYNCH) requests */
+	uint64_t time_extensions;	/* CCID time extensions and T=1 WTX */
+	uint64_t timeouts;	/* reads or writes that timed out */
+	uint64_t transport_time_us;	/* time spent in ReadPort and WritePort */
+
+	struct ccid_latency transmit_latency;	/* IFDHTransmitToICC() */
+	struct ccid_latency power_latency;	/* IFDHPowerICC() power up and reset */
+	struct ccid_latency presence_latency;	/* card status request */
+};
+
+/* never NULL, indexed by reader_index */
+extern struct ccid_counters *Counters;
+
+void counters_init(void);
+void counters_open(unsigned int reader_index, unsigned int lun,
+	unsigned int readerID, unsigned int slot);
+void counters_close(unsigned int reader_index);
+void counters_latency(struct ccid_latency *latency, uint64_t start_us);
+void counters_latency_reset(unsigned int reader_index);
+
+#endif
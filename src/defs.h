@@ -23,6 +23,54 @@
 
 #include "openct/proto-t1.h"
 
+/* Number of protocol negotiations remembered per slot */
+#define NEGOTIATION_CACHE_SIZE 4
+
+/*
+ * Result of a successful IFDHSetProtocolParameters() for a given ATR
+ */
+typedef struct
+{
+	/*
+	 * Key: ATR and requested parameters
+	 * nATRLength is 0 for an unused entry
+	 */
+	int nATRLength;
+	unsigned char pcATRBuffer[MAX_ATR_SIZE];
+	DWORD dwRequestedProtocol;
+	unsigned char bFlags;
+	unsigned char bPTS[3];
+
+	/*
+	 * Negotiated protocol (SCARD_PROTOCOL_T0 or SCARD_PROTOCOL_T1)
+	 */
+	DWORD dwProtocol;
+
+	/*
+	 * PPS request sent to the card (PPS_MAX_LENGTH bytes)
+	 * pps[0] is 0 if no PPS is needed
+	 */
+	unsigned char pps[6];
+
+	/*
+	 * SetParameters abProtocolDataStructure
+	 * bParamLength is 0 if SetParameters is not needed
+	 */
+	unsigned char param[7];
+	unsigned char bParamLength;
+
+	/*
+	 * Communication timeout in milliseconds
+	 */
+	unsigned int readTimeout;
+
+	/*
+	 * T=1: checksum (-1 for the default) and IFSC (-1 for the default)
+	 */
+	int checksum;
+	int ifsc;
+} NegotiationCache;
+
 typedef struct CCID_DESC
 {
 	/*
@@ -43,6 +91,18 @@ typedef struct CCID_DESC
 
 	/* reader name passed to IFDHCreateChannelByName() */
 	char *readerName;
+
+	/*
+	 * Protocol negotiations already done on this slot
+	 */
+	NegotiationCache negotiation[NEGOTIATION_CACHE_SIZE];
+	int negotiation_next;
+
+	/*
+	 * PIN operation started by FEATURE_VERIFY_PIN_START or
+	 * FEATURE_MODIFY_PIN_START (or NULL)
+	 */
+	struct secure_pin *secure_pin;
 } CcidDesc;
 
 typedef enum {
@@ -51,6 +51,7 @@
 #include "parser.h"
 #include "strlcpycat.h"
 #include "sys_generic.h"
+#include "counters.h"
 
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
@@ -77,6 +78,16 @@ static unsigned int T0_card_timeout(double f, double d, int TC1, int TC2,
 static unsigned int T1_card_timeout(double f, double d, int TC1, int BWI,
 	int CWI, int clock_frequency);
 static int get_IFSC(ATR_t *atr, int *i);
+static int get_class_indicator(ATR_t *atr);
+static int select_voltage(_ccid_descriptor *ccid_descriptor,
+	unsigned char atr[], unsigned int atr_len);
+static unsigned char select_TA1(_ccid_descriptor *ccid_desc, ATR_t *atr,
+	unsigned int default_baudrate);
+static RESPONSECODE set_T1_IFSC_IFSD(int reader_index, int ifsc);
+static NegotiationCache *find_negotiation(CcidDesc *ccid_slot,
+	DWORD Protocol, UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3);
+static RESPONSECODE apply_negotiation(int reader_index,
+	const NegotiationCache *entry);
 
 static void FreeChannel(int reader_index)
 {
@@ -85,6 +96,7 @@ static void FreeChannel(int reader_index)
 #endif
 
 	(void)ClosePort(reader_index);
+	counters_close(reader_index);
 
 	free(CcidSlots[reader_index].readerName);
 	memset(&CcidSlots[reader_index], 0, sizeof(CcidSlots[reader_index]));
@@ -171,6 +183,9 @@ static RESPONSECODE CreateChannelByNameOrChannel(DWORD Lun,
 		RESPONSECODE cmd_ret;
 		_ccid_descriptor *ccid_descriptor = get_ccid_descriptor(reader_index);
 
+		counters_open(reader_index, Lun, ccid_descriptor->readerID,
+			ccid_descriptor->bCurrentSlotIndex);
+
 		/* Maybe we have a special treatment for this reader */
 		(void)ccid_open_hack_pre(reader_index);
 
@@ -292,6 +307,9 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 	DEBUG_INFO3(LOG_STRING " (lun: " DWORD_X ")", CcidSlots[reader_index].readerName,
 		Lun);
 
+	/* a PIN entry may still be in progress */
+	SecurePINCancel(reader_index);
+
 	/* Restore the default timeout
 	 * No need to wait too long if the reader disappeared */
 	get_ccid_descriptor(reader_index)->readTimeout = DEFAULT_COM_READ_TIMEOUT;
@@ -507,6 +525,14 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 					*Value = 1; /* all slots can be used simultanesously */
 				else
 					*Value = 0; /* Can NOT talk to multiple slots at the same time */
+#ifdef USE_COMPOSITE_AS_MULTISLOT
+				/* the "slots" are the CCID interfaces of a composite
+				 * reader, not given by the CCID descriptor */
+				if (ccid_desc->dwQuirks & QUIRK_COMPOSITE_CONCURRENT)
+					*Value = 1;
+				if (ccid_desc->dwQuirks & QUIRK_COMPOSITE_EXCLUSIVE)
+					*Value = 0;
+#endif
 			}
 			else
 				return_value = IFD_ERROR_INSUFFICIENT_BUFFER;
@@ -642,6 +668,30 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 			}
 			break;
 
+		case SCARD_ATTR_CCID_LATENCY_TRANSMIT:
+		case SCARD_ATTR_CCID_LATENCY_POWER:
+		case SCARD_ATTR_CCID_LATENCY_PRESENCE:
+			{
+				struct ccid_latency *latency;
+
+				if (SCARD_ATTR_CCID_LATENCY_TRANSMIT == Tag)
+					latency = &Counters[reader_index].transmit_latency;
+				else if (SCARD_ATTR_CCID_LATENCY_POWER == Tag)
+					latency = &Counters[reader_index].power_latency;
+				else
+					latency = &Counters[reader_index].presence_latency;
+
+				if (*Length >= sizeof *latency)
+				{
+					*Length = sizeof *latency;
+					if (Value)
+						memcpy(Value, latency, *Length);
+				}
+				else
+					return_value = IFD_ERROR_INSUFFICIENT_BUFFER;
+			}
+			break;
+
 #if !defined(TWIN_SERIAL)
 		case SCARD_ATTR_CHANNEL_ID:
 			{
@@ -704,6 +754,10 @@ EXTERNAL RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag,
 			break;
 #endif
 
+		case SCARD_ATTR_CCID_LATENCY_RESET:
+			counters_latency_reset(reader_index);
+			break;
+
 		default:
 			return_value = IFD_ERROR_TAG;
 	}
@@ -740,6 +794,7 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 	int convention;
 	int reader_index;
 	int atr_ret;
+	NegotiationCache entry, *cache;
 
 	/* Set ccid desc params */
 	CcidDesc *ccid_slot;
@@ -751,6 +806,13 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 	DEBUG_INFO4("protocol T=" DWORD_D ", " LOG_STRING " (lun: " DWORD_X ")",
 		Protocol-SCARD_PROTOCOL_T0, CcidSlots[reader_index].readerName, Lun);
 
+	/* the slot is waiting for the end of a PIN entry */
+	if (SecurePINBusy(reader_index))
+	{
+		DEBUG_CRITICAL("PIN operation in progress");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
 	/* Set to zero buffer */
 	memset(pps, 0, sizeof(pps));
 	memset(&atr, 0, sizeof(atr));
@@ -767,6 +829,36 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 		return IFD_ERROR_NOT_SUPPORTED;
 	}
 
+	/* same card and same request as a previous successful negotiation? */
+	cache = find_negotiation(ccid_slot, Protocol, Flags, PTS1, PTS2, PTS3);
+	if (cache)
+	{
+		RESPONSECODE ret;
+
+		ret = apply_negotiation(reader_index, cache);
+		if (IFD_SUCCESS != ret)
+		{
+			/* the card is in an unknown state now. Forget the entry so the
+			 * next connection (after a reset) does the full negotiation */
+			DEBUG_INFO1("Cached negotiation failed");
+			cache->nATRLength = 0;
+		}
+
+		return ret;
+	}
+
+	/* negotiation result to remember */
+	memset(&entry, 0, sizeof(entry));
+	entry.nATRLength = ccid_slot->nATRLength;
+	memcpy(entry.pcATRBuffer, ccid_slot->pcATRBuffer, ccid_slot->nATRLength);
+	entry.dwRequestedProtocol = Protocol;
+	entry.bFlags = Flags;
+	entry.bPTS[0] = PTS1;
+	entry.bPTS[1] = PTS2;
+	entry.bPTS[2] = PTS3;
+	entry.checksum = -1;
+	entry.ifsc = -1;
+
 	/* Get ATR of the card */
 	atr_ret = ATR_InitFromArray(&atr, ccid_slot->pcATRBuffer,
 		ccid_slot->nATRLength);
@@ -807,13 +899,15 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 				if (0 == atr.ib[i][ATR_INTERFACE_BYTE_TC].value)
 				{
 					DEBUG_COMM("Use LRC");
-					(void)t1_set_param(t1, IFD_PROTOCOL_T1_CHECKSUM_LRC, 0);
+					entry.checksum = IFD_PROTOCOL_T1_CHECKSUM_LRC;
+					(void)t1_set_param(t1, entry.checksum, 0);
 				}
 				else
 					if (1 == atr.ib[i][ATR_INTERFACE_BYTE_TC].value)
 					{
 						DEBUG_COMM("Use CRC");
-						(void)t1_set_param(t1, IFD_PROTOCOL_T1_CHECKSUM_CRC, 0);
+						entry.checksum = IFD_PROTOCOL_T1_CHECKSUM_CRC;
+						(void)t1_set_param(t1, entry.checksum, 0);
 					}
 					else
 						DEBUG_COMM2("Wrong value for TCi: %d",
@@ -866,80 +960,26 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 			DEBUG_COMM2("Card can work at %d bauds", card_baudrate);
 
 			/* if the card does not try to lower the default speed */
-			if ((card_baudrate > default_baudrate)
-				/* and the reader is fast enough */
-				&& (card_baudrate <= ccid_desc->dwMaxDataRate))
+			if (card_baudrate > default_baudrate)
 			{
-				/* the reader has no baud rates table */
-				if ((NULL == ccid_desc->arrayOfSupportedDataRates)
-					/* or explicitly support it */
-					|| find_baud_rate(card_baudrate,
-						ccid_desc->arrayOfSupportedDataRates))
+				unsigned char TA1;
+
+				TA1 = select_TA1(ccid_desc, &atr, default_baudrate);
+				if (TA1)
 				{
 					pps[1] |= 0x10; /* PTS1 presence */
-					pps[2] = atr.ib[0][ATR_INTERFACE_BYTE_TA].value;
-
-					DEBUG_COMM2("Set speed to %d bauds", card_baudrate);
+					pps[2] = TA1;
 				}
-				else
+
+				/* TA2 present -> specific mode: the card is supporting
+				 * only the baud rate specified in TA1 but reader does not
+				 * support this value. Reject the card. */
+				if (atr.ib[1][ATR_INTERFACE_BYTE_TA].present
+					&& (TA1 != atr.ib[0][ATR_INTERFACE_BYTE_TA].value))
 				{
 					DEBUG_COMM2("Reader does not support %d bauds",
 						card_baudrate);
-
-					/* TA2 present -> specific mode: the card is supporting
-					 * only the baud rate specified in TA1 but reader does not
-					 * support this value. Reject the card. */
-					if (atr.ib[1][ATR_INTERFACE_BYTE_TA].present)
-						return IFD_COMMUNICATION_ERROR;
-				}
-			}
-			else
-			{
-				/* the card is too fast for the reader */
-				if ((card_baudrate > ccid_desc->dwMaxDataRate +2)
-					/* but TA1 <= 97 */
-					&& (atr.ib[0][ATR_INTERFACE_BYTE_TA].value <= 0x97))
-				{
-					unsigned char old_TA1;
-
-					DEBUG_COMM2("Reader can't do more than %d bauds",
-						ccid_desc->dwMaxDataRate);
-
-					old_TA1 = atr.ib[0][ATR_INTERFACE_BYTE_TA].value;
-					while (atr.ib[0][ATR_INTERFACE_BYTE_TA].value > 0x94)
-					{
-						/* use a lower TA1 */
-						atr.ib[0][ATR_INTERFACE_BYTE_TA].value--;
-
-						(void)ATR_GetParameter(&atr, ATR_PARAMETER_D, &d);
-						(void)ATR_GetParameter(&atr, ATR_PARAMETER_F, &f);
-
-						/* Baudrate = f x D/F */
-						card_baudrate = (unsigned int) (1000 *
-							ccid_desc->dwDefaultClock * d / f);
-
-						/* the reader has a baud rate table */
-						if ((ccid_desc->arrayOfSupportedDataRates
-							/* and the baud rate is supported */
-							&& find_baud_rate(card_baudrate,
-							ccid_desc->arrayOfSupportedDataRates))
-							/* or the reader has NO baud rate table */
-							|| ((NULL == ccid_desc->arrayOfSupportedDataRates)
-							/* and the baud rate is below the limit */
-							&& (card_baudrate <= ccid_desc->dwMaxDataRate)))
-						{
-							pps[1] |= 0x10; /* PTS1 presence */
-							pps[2] = atr.ib[0][ATR_INTERFACE_BYTE_TA].value;
-
-							DEBUG_COMM2("Set adapted speed to %d bauds",
-								card_baudrate);
-
-							break;
-						}
-					}
-
-					/* restore original TA1 value */
-					atr.ib[0][ATR_INTERFACE_BYTE_TA].value = old_TA1;
+					return IFD_COMMUNICATION_ERROR;
 				}
 			}
 		}
@@ -987,11 +1027,16 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 			}
 			else
 #endif
-			if (PPS_Exchange(reader_index, pps, &len, &pps[2]) != PPS_OK)
 			{
-				DEBUG_INFO1("PPS_Exchange Failed");
+				/* the PPS request is modified by PPS_Exchange() */
+				memcpy(entry.pps, pps, sizeof(entry.pps));
+
+				if (PPS_Exchange(reader_index, pps, &len, &pps[2]) != PPS_OK)
+				{
+					DEBUG_INFO1("PPS_Exchange Failed");
 
-				return IFD_ERROR_PTS_FAILURE;
+					return IFD_ERROR_PTS_FAILURE;
+				}
 			}
 		}
 	}
@@ -1089,9 +1134,15 @@ end:
 			DEBUG_COMM("Skip SetParameters");
 		else
 		{
+			memcpy(entry.param, param, sizeof(param));
+			entry.bParamLength = sizeof(param);
+
 			ret = SetParameters(reader_index, 1, sizeof(param), param);
 			if (IFD_SUCCESS != ret)
 			{
+				/* do not remember a failed negotiation */
+				entry.nATRLength = 0;
+
 				if (ALCORMICRO_AU9540 == ccid_desc -> readerID)
 				{
 					/* Set Parameters failed
@@ -1157,43 +1208,159 @@ end:
 			DEBUG_COMM("Skip SetParameters");
 		else
 		{
+			memcpy(entry.param, param, sizeof(param));
+			entry.bParamLength = sizeof(param);
+
 			ret = SetParameters(reader_index, 0, sizeof(param), param);
 			if (IFD_SUCCESS != ret)
 				return ret;
 		}
 	}
+	entry.readTimeout = ccid_desc->readTimeout;
 
 	/* set IFSC & IFSD in T=1 */
-	if ((SCARD_PROTOCOL_T1 == Protocol)
-		&& (CCID_CLASS_TPDU == (ccid_desc->dwFeatures & CCID_CLASS_EXCHANGE_MASK)))
+	if (SCARD_PROTOCOL_T1 == Protocol)
 	{
-		t1_state_t *t1 = &(ccid_slot -> t1);
-		int i, ifsc;
+		RESPONSECODE ret;
+		int i;
 
-		ifsc = get_IFSC(&atr, &i);
-		if (ifsc > 0)
+		entry.ifsc = get_IFSC(&atr, &i);
+		ret = set_T1_IFSC_IFSD(reader_index, entry.ifsc);
+		if (IFD_SUCCESS != ret)
+			return ret;
+	}
+
+	/* store used protocol for use by the secure commands (verify/change PIN) */
+	ccid_desc->cardProtocol = Protocol;
+
+	/* remember the negotiation for the next connection of the same card */
+	if (entry.nATRLength)
+	{
+		entry.dwProtocol = Protocol;
+		ccid_slot->negotiation[ccid_slot->negotiation_next] = entry;
+		ccid_slot->negotiation_next = (ccid_slot->negotiation_next + 1)
+			% NEGOTIATION_CACHE_SIZE;
+	}
+
+	return IFD_SUCCESS;
+} /* IFDHSetProtocolParameters */
+
+
+static RESPONSECODE set_T1_IFSC_IFSD(int reader_index, int ifsc)
+{
+	t1_state_t *t1 = &(get_ccid_slot(reader_index) -> t1);
+	_ccid_descriptor *ccid_desc = get_ccid_descriptor(reader_index);
+
+	/* only for TPDU readers */
+	if (CCID_CLASS_TPDU != (ccid_desc->dwFeatures & CCID_CLASS_EXCHANGE_MASK))
+		return IFD_SUCCESS;
+
+	if (ifsc > 0)
+		(void)t1_set_param(t1, IFD_PROTOCOL_T1_IFSC, ifsc);
+
+	/* IFSD not negotiated by the reader? */
+	if (! (ccid_desc->dwFeatures & CCID_CLASS_AUTO_IFSD))
+	{
+		DEBUG_COMM2("Negotiate IFSD at %d", ccid_desc -> dwMaxIFSD);
+		if (t1_negotiate_ifsd(t1, 0, ccid_desc -> dwMaxIFSD) < 0)
+			return IFD_COMMUNICATION_ERROR;
+	}
+	(void)t1_set_param(t1, IFD_PROTOCOL_T1_IFSD, ccid_desc -> dwMaxIFSD);
+
+	DEBUG_COMM3("T=1: IFSC=%d, IFSD=%d", t1->ifsc, t1->ifsd);
+
+	return IFD_SUCCESS;
+} /* set_T1_IFSC_IFSD */
+
+
+static NegotiationCache *find_negotiation(CcidDesc *ccid_slot,
+	DWORD Protocol, UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
+{
+	int i;
+
+	for (i=0; i<NEGOTIATION_CACHE_SIZE; i++)
+	{
+		NegotiationCache *entry = &ccid_slot->negotiation[i];
+
+		if (entry->nATRLength
+			&& (entry->nATRLength == ccid_slot->nATRLength)
+			&& (0 == memcmp(entry->pcATRBuffer, ccid_slot->pcATRBuffer,
+				entry->nATRLength))
+			&& (entry->dwRequestedProtocol == Protocol)
+			&& (entry->bFlags == Flags)
+			&& (entry->bPTS[0] == PTS1)
+			&& (entry->bPTS[1] == PTS2)
+			&& (entry->bPTS[2] == PTS3))
+			return entry;
+	}
+
+	return NULL;
+} /* find_negotiation */
+
+
+static RESPONSECODE apply_negotiation(int reader_index,
+	const NegotiationCache *entry)
+{
+	_ccid_descriptor *ccid_desc = get_ccid_descriptor(reader_index);
+	t1_state_t *t1 = &(get_ccid_slot(reader_index) -> t1);
+	RESPONSECODE ret;
+
+	DEBUG_COMM2("Use the negotiation cached for this ATR: T=" DWORD_D,
+		entry->dwProtocol - SCARD_PROTOCOL_T0);
+
+	if (entry->checksum >= 0)
+		(void)t1_set_param(t1, entry->checksum, 0);
+
+	/* the card expects the PPS again after each reset */
+	if (entry->pps[0])
+	{
+		BYTE pps[PPS_MAX_LENGTH];
+		unsigned int len;
+		unsigned char pps1;
+
+		memcpy(pps, entry->pps, sizeof(pps));
+		if (PPS_Exchange(reader_index, pps, &len, &pps1) != PPS_OK)
 		{
-			DEBUG_COMM3("IFSC (TA%d) present: %d", i, ifsc);
-			(void)t1_set_param(t1, IFD_PROTOCOL_T1_IFSC, ifsc);
+			DEBUG_INFO1("PPS_Exchange Failed");
+			return IFD_ERROR_PTS_FAILURE;
 		}
 
-		/* IFSD not negotiated by the reader? */
-		if (! (ccid_desc->dwFeatures & CCID_CLASS_AUTO_IFSD))
+		/* the card must select the same Fi/Di as last time */
+		if (entry->bParamLength && (pps1 != entry->param[0]))
 		{
-			DEBUG_COMM2("Negotiate IFSD at %d", ccid_desc -> dwMaxIFSD);
-			if (t1_negotiate_ifsd(t1, 0, ccid_desc -> dwMaxIFSD) < 0)
-				return IFD_COMMUNICATION_ERROR;
+			DEBUG_INFO3("PPS1 changed: 0x%02X instead of 0x%02X", pps1,
+				entry->param[0]);
+			return IFD_ERROR_PTS_FAILURE;
 		}
-		(void)t1_set_param(t1, IFD_PROTOCOL_T1_IFSD, ccid_desc -> dwMaxIFSD);
+	}
 
-		DEBUG_COMM3("T=1: IFSC=%d, IFSD=%d", t1->ifsc, t1->ifsd);
+	ccid_desc->readTimeout = entry->readTimeout;
+	DEBUG_COMM2("Timeout: %d ms", ccid_desc->readTimeout);
+
+	if (entry->bParamLength)
+	{
+		unsigned char param[sizeof(entry->param)];
+
+		memcpy(param, entry->param, entry->bParamLength);
+		ret = SetParameters(reader_index,
+			SCARD_PROTOCOL_T1 == entry->dwProtocol, entry->bParamLength,
+			param);
+		if (IFD_SUCCESS != ret)
+			return ret;
+	}
+
+	if (SCARD_PROTOCOL_T1 == entry->dwProtocol)
+	{
+		ret = set_T1_IFSC_IFSD(reader_index, entry->ifsc);
+		if (IFD_SUCCESS != ret)
+			return ret;
 	}
 
 	/* store used protocol for use by the secure commands (verify/change PIN) */
-	ccid_desc->cardProtocol = Protocol;
+	ccid_desc->cardProtocol = entry->dwProtocol;
 
 	return IFD_SUCCESS;
-} /* IFDHSetProtocolParameters */
+} /* apply_negotiation */
 
 
 EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
@@ -1244,6 +1411,9 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 #endif
 	unsigned int oldReadTimeout;
 	_ccid_descriptor *ccid_descriptor;
+	bool same_card;
+	int voltage;
+	uint64_t start;
 
 	/* By default, assume it won't work :) */
 	*AtrLength = 0;
@@ -1254,6 +1424,11 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 	DEBUG_INFO4("action: " LOG_STRING ", " LOG_STRING " (lun: " DWORD_X ")",
 		actions[Action-IFD_POWER_UP], CcidSlots[reader_index].readerName, Lun);
 
+	/* a PIN entry may still be in progress */
+	SecurePINCancel(reader_index);
+
+	start = get_time_us();
+
 	switch (Action)
 	{
 		case IFD_POWER_DOWN:
@@ -1287,7 +1462,7 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 
 			/* The German eID card is bogus and need to be powered off
 			 * before a power on */
-			if (KOBIL_IDTOKEN == ccid_descriptor -> readerID)
+			if (ccid_descriptor->dwQuirks & QUIRK_POWER_OFF_BEFORE_ON)
 			{
 				/* send the command */
 				if (IFD_SUCCESS != CmdPowerOff(reader_index))
@@ -1308,9 +1483,31 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			 */
 			ccid_descriptor->readTimeout = 60*1000;
 
+			/* start with the voltage that worked last time in this slot
+			 * instead of failing activations at the other voltages */
+			voltage = PowerOnVoltage;
+			if ((ccid_descriptor->learnedVoltage > 0)
+				&& (PowerOnVoltage != VOLTAGE_AUTO))
+				voltage = ccid_descriptor->learnedVoltage;
+
 			nlength = sizeof(pcbuffer);
 			return_value = CmdPowerOn(reader_index, &nlength, pcbuffer,
-				PowerOnVoltage);
+				voltage);
+
+			/* the card indicates it does not support this class? */
+			if (IFD_SUCCESS == return_value)
+			{
+				voltage = select_voltage(ccid_descriptor, pcbuffer, nlength);
+				if (voltage > 0)
+				{
+					/* deactivate before changing the class */
+					(void)CmdPowerOff(reader_index);
+
+					nlength = sizeof(pcbuffer);
+					return_value = CmdPowerOn(reader_index, &nlength,
+						pcbuffer, voltage);
+				}
+			}
 
 			/* set back the old timeout */
 			ccid_descriptor->readTimeout = oldReadTimeout;
@@ -1318,7 +1515,7 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			if (return_value != IFD_SUCCESS)
 			{
 				/* used by GemCore SIM PRO: no card is present */
-				if (GEMCORESIMPRO == ccid_descriptor -> readerID)
+				if (ccid_descriptor->dwQuirks & QUIRK_ABSENT_ON_POWER_FAILURE)
 					get_ccid_descriptor(reader_index)->dwSlotStatus
 						= IFD_ICC_NOT_PRESENT;
 
@@ -1332,13 +1529,31 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			CcidSlots[reader_index].bPowerFlags &= ~MASK_POWERFLAGS_PDWN;
 
 			/* Reset is returned, even if TCK is wrong */
-			CcidSlots[reader_index].nATRLength = *AtrLength =
-				(nlength < MAX_ATR_SIZE) ? nlength : MAX_ATR_SIZE;
+			*AtrLength = (nlength < MAX_ATR_SIZE) ? nlength : MAX_ATR_SIZE;
+
+			/* warm reset of the same card? */
+			same_card = (IFD_RESET == Action)
+				&& (CcidSlots[reader_index].nATRLength == (int)*AtrLength)
+				&& (0 == memcmp(CcidSlots[reader_index].pcATRBuffer, pcbuffer,
+					*AtrLength));
+
+			CcidSlots[reader_index].nATRLength = *AtrLength;
 			memcpy(Atr, pcbuffer, *AtrLength);
 			memcpy(CcidSlots[reader_index].pcATRBuffer, pcbuffer, *AtrLength);
 
-			/* initialise T=1 context */
+			/* initialise T=1 context
+			 * The card restarts its block numbering after any reset */
 			(void)t1_init(&(get_ccid_slot(reader_index) -> t1), reader_index);
+
+			/* The card is back to the default Fi/Di and IFSD so the PPS,
+			 * SetParameters and IFSD negotiation are needed again even for
+			 * the same card. IFDHSetProtocolParameters() replays them from
+			 * the negotiation cache without analysing the ATR. */
+			if (same_card)
+				DEBUG_COMM("Same ATR after reset");
+			else
+				/* response times of the previous card are not relevant */
+				ccid_descriptor -> xfrLatencySamples = 0;
 			break;
 
 		default:
@@ -1346,6 +1561,8 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			return_value = IFD_NOT_SUPPORTED;
 	}
 end:
+	if ((IFD_POWER_UP == Action) || (IFD_RESET == Action))
+		counters_latency(&Counters[reader_index].power_latency, start);
 
 	return return_value;
 } /* IFDHPowerICC */
@@ -1395,6 +1612,7 @@ EXTERNAL RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 	int old_read_timeout;
 	bool restore_timeout = false;
 	_ccid_descriptor *ccid_descriptor;
+	uint64_t start;
 
 	(void)RecvPci;
 
@@ -1406,8 +1624,16 @@ EXTERNAL RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 	DEBUG_INFO3(LOG_STRING " (lun: " DWORD_X ")", CcidSlots[reader_index].readerName,
 		Lun);
 
+	/* the slot is waiting for the end of a PIN entry */
+	if (SecurePINBusy(reader_index))
+	{
+		DEBUG_CRITICAL("PIN operation in progress");
+		*RxLength = 0;
+		return IFD_COMMUNICATION_ERROR;
+	}
+
 	/* special APDU for the Kobil IDToken (CLASS = 0xFF) */
-	if (KOBIL_IDTOKEN == ccid_descriptor -> readerID)
+	if (ccid_descriptor->dwQuirks & QUIRK_IDTOKEN_PSEUDO_APDU)
 	{
 		char manufacturer[] = {0xFF, 0x9A, 0x01, 0x01, 0x00};
 		char product_name[] = {0xFF, 0x9A, 0x01, 0x03, 0x00};
@@ -1467,9 +1693,13 @@ EXTERNAL RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 		ccid_descriptor -> readTimeout = 90 * 1000;	/* 90 seconds */
 	}
 
+	Counters[reader_index].apdus++;
+	start = get_time_us();
+
 	rx_length = *RxLength;
 	return_value = CmdXfrBlock(reader_index, TxLength, TxBuffer, &rx_length,
 		RxBuffer, SendPci.Protocol);
+	counters_latency(&Counters[reader_index].transmit_latency, start);
 	if (IFD_SUCCESS == return_value)
 		*RxLength = rx_length;
 	else
@@ -1518,6 +1748,20 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 	/* Set the return length to 0 to avoid problems */
 	*pdwBytesReturned = 0;
 
+	/* the slot is waiting for the end of a PIN entry
+	 * Only the commands not using the reader are possible */
+	if (SecurePINBusy(reader_index)
+		&& (IOCTL_FEATURE_VERIFY_PIN_FINISH != dwControlCode)
+		&& (IOCTL_FEATURE_MODIFY_PIN_FINISH != dwControlCode)
+		&& (IOCTL_FEATURE_GET_KEY_PRESSED != dwControlCode)
+		&& (IOCTL_FEATURE_ABORT != dwControlCode)
+		&& (IOCTL_FEATURE_IFD_PIN_PROPERTIES != dwControlCode)
+		&& (CM_IOCTL_GET_FEATURE_REQUEST != dwControlCode))
+	{
+		DEBUG_CRITICAL("PIN operation in progress");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
 	if (IOCTL_SMARTCARD_VENDOR_IFD_EXCHANGE == dwControlCode)
 	{
 		bool allowed = (DriverOptions & DRIVER_OPTION_CCID_EXCHANGE_AUTHORIZED);
@@ -1575,11 +1819,11 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 		PCSC_TLV_STRUCTURE *pcsc_tlv = (PCSC_TLV_STRUCTURE *)RxBuffer;
 		int readerID = ccid_descriptor -> readerID;
 
-		/* we need room for up to six records */
-		if (RxLength < 6 * sizeof(PCSC_TLV_STRUCTURE))
+		/* we need room for up to twelve records */
+		if (RxLength < 12 * sizeof(PCSC_TLV_STRUCTURE))
 			return IFD_ERROR_INSUFFICIENT_BUFFER;
 
-		/* We can only support direct verify and/or modify currently */
+		/* direct or start/finish verify and/or modify */
 		if (ccid_descriptor -> bPINSupport & CCID_CLASS_PIN_VERIFY)
 		{
 			pcsc_tlv -> tag = FEATURE_VERIFY_PIN_DIRECT;
@@ -1589,6 +1833,22 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 
 			pcsc_tlv++;
 			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			pcsc_tlv -> tag = FEATURE_VERIFY_PIN_START;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_VERIFY_PIN_START));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			pcsc_tlv -> tag = FEATURE_VERIFY_PIN_FINISH;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_VERIFY_PIN_FINISH));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
 		}
 
 		if (ccid_descriptor -> bPINSupport & CCID_CLASS_PIN_MODIFY)
@@ -1600,6 +1860,22 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 
 			pcsc_tlv++;
 			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			pcsc_tlv -> tag = FEATURE_MODIFY_PIN_START;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_MODIFY_PIN_START));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			pcsc_tlv -> tag = FEATURE_MODIFY_PIN_FINISH;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_MODIFY_PIN_FINISH));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
 		}
 
 		/* Provide IFD_PIN_PROPERTIES only for pinpad readers */
@@ -1612,6 +1888,23 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 
 			pcsc_tlv++;
 			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			/* end and cancellation of a started PIN operation */
+			pcsc_tlv -> tag = FEATURE_GET_KEY_PRESSED;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_GET_KEY_PRESSED));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
+
+			pcsc_tlv -> tag = FEATURE_ABORT;
+			pcsc_tlv -> length = 0x04; /* always 0x04 */
+			set_U32(&pcsc_tlv -> value,
+				htonl(IOCTL_FEATURE_ABORT));
+
+			pcsc_tlv++;
+			iBytesReturned += sizeof(PCSC_TLV_STRUCTURE);
 		}
 
 		if ((KOBIL_TRIBANK == readerID)
@@ -1900,6 +2193,41 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 		*pdwBytesReturned = iBytesReturned;
 	}
 
+	/* Start a PIN verification or modification, plain CCID
+	 * The end of the PIN entry is reported by FEATURE_GET_KEY_PRESSED and
+	 * the card response is returned by the FINISH command */
+	if ((IOCTL_FEATURE_VERIFY_PIN_START == dwControlCode)
+		|| (IOCTL_FEATURE_MODIFY_PIN_START == dwControlCode))
+	{
+		return_value = SecurePINStart(reader_index,
+			IOCTL_FEATURE_VERIFY_PIN_START == dwControlCode,
+			TxBuffer, TxLength);
+	}
+
+	if ((IOCTL_FEATURE_VERIFY_PIN_FINISH == dwControlCode)
+		|| (IOCTL_FEATURE_MODIFY_PIN_FINISH == dwControlCode))
+	{
+		unsigned int iBytesReturned;
+
+		iBytesReturned = RxLength;
+		return_value = SecurePINFinish(reader_index, RxBuffer,
+			&iBytesReturned);
+		*pdwBytesReturned = iBytesReturned;
+	}
+
+	if (IOCTL_FEATURE_GET_KEY_PRESSED == dwControlCode)
+	{
+		if (RxLength < 1)
+			return IFD_ERROR_INSUFFICIENT_BUFFER;
+
+		return_value = SecurePINKeyPressed(reader_index, RxBuffer);
+		if (IFD_SUCCESS == return_value)
+			*pdwBytesReturned = 1;
+	}
+
+	if (IOCTL_FEATURE_ABORT == dwControlCode)
+		return_value = SecurePINAbort(reader_index);
+
 	/* MCT: Multifunctional Card Terminal */
 	if (IOCTL_FEATURE_MCT_READER_DIRECT == dwControlCode)
 	{
@@ -1956,16 +2284,24 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 	int reader_index;
 	_ccid_descriptor *ccid_descriptor;
 	unsigned int oldReadTimeout;
+	uint64_t start;
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
 	DEBUG_PERIODIC3(LOG_STRING " (lun: " DWORD_X ")", CcidSlots[reader_index].readerName, Lun);
 
+	/* the slot is waiting for the end of a PIN entry. A card is needed
+	 * for the PIN operation and its removal will end the operation */
+	if (SecurePINBusy(reader_index))
+	{
+		return_value = IFD_ICC_PRESENT;
+		goto end;
+	}
+
 	ccid_descriptor = get_ccid_descriptor(reader_index);
 
-	if ((GEMCORESIMPRO == ccid_descriptor->readerID)
-		&& (ccid_descriptor->IFD_bcdDevice < 0x0200))
+	if (ccid_descriptor->dwQuirks & QUIRK_SIMULATED_SLOT_STATUS)
 	{
 		/* GemCore SIM Pro firmware 2.00 and up features
 		 * a full independent second slot */
@@ -1984,7 +2320,9 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 	if (! (LogLevel & DEBUG_LEVEL_PERIODIC))
 		LogLevel &= ~DEBUG_LEVEL_COMM;
 
+	start = get_time_us();
 	return_value = CmdGetSlotStatus(reader_index, pcbuffer);
+	counters_latency(&Counters[reader_index].presence_latency, start);
 
 	/* set back the old timeout */
 	ccid_descriptor->readTimeout = oldReadTimeout;
@@ -2143,6 +2481,26 @@ void init_driver(void)
 			DEBUG_INFO2("DriverOptions: 0x%.4X", DriverOptions);
 		}
 
+		/* firmwares known to refuse the exchange level switch */
+		rv = LTPBundleFindValueWithKey(&plist, "ifdExchangeLevelRefused",
+			&values);
+		if (0 == rv)
+		{
+			unsigned int i;
+
+			for (i=0; i<list_size(values); i++)
+			{
+				int readerID, bcdDevice;
+
+				if (2 == sscanf(list_get_at(values, i), "%i/%i",
+					&readerID, &bcdDevice))
+					ccid_exchange_level_refused(readerID, bcdDevice);
+				else
+					DEBUG_CRITICAL2("Wrong ifdExchangeLevelRefused value: %s",
+						(char *)list_get_at(values, i));
+			}
+		}
+
 		bundleRelease(&plist);
 	}
 
@@ -2176,6 +2534,9 @@ void init_driver(void)
 			break;
 	}
 
+	/* publish the counters if DRIVER_OPTION_SHM_COUNTERS is set */
+	counters_init();
+
 	/* initialise the Lun to reader_index mapping */
 	InitReaderIndex();
 
@@ -2183,6 +2544,76 @@ void init_driver(void)
 } /* init_driver */
 
 
+/*
+ * Select the fastest Fi/Di supported by the card and the reader
+ *
+ * The card works with the Fi of TA1 and any Di up to the one of TA1.
+ * The legal Di values are scored by the resulting baud rate and the
+ * fastest one supported by the reader is returned as a PPS1 value. 0 is
+ * returned if no value is faster than the default speed.
+ */
+static unsigned char select_TA1(_ccid_descriptor *ccid_desc, ATR_t *atr,
+	unsigned int default_baudrate)
+{
+	unsigned char card_TA1 = atr->ib[0][ATR_INTERFACE_BYTE_TA].value;
+	unsigned char TA1 = 0;
+	unsigned int best_baudrate = default_baudrate;
+	double f, d, card_d;
+	int i;
+
+	(void)ATR_GetParameter(atr, ATR_PARAMETER_D, &card_d);
+
+	for (i=1; i<16; i++)
+	{
+		unsigned int baudrate;
+
+		/* ATR_GetParameter() reads TA1 from the ATR */
+		atr->ib[0][ATR_INTERFACE_BYTE_TA].value = (card_TA1 & 0xF0) | i;
+		(void)ATR_GetParameter(atr, ATR_PARAMETER_F, &f);
+		(void)ATR_GetParameter(atr, ATR_PARAMETER_D, &d);
+
+		/* RFU value or Di not supported by the card */
+		if ((0 == f) || (0 == d) || (d > card_d))
+			continue;
+
+		/* Baudrate = f x D/F */
+		baudrate = (unsigned int) (1000 * ccid_desc->dwDefaultClock * d / f);
+
+		/* not better than what we have */
+		if (baudrate <= best_baudrate)
+			continue;
+
+		/* the reader is fast enough */
+		if ((baudrate <= ccid_desc->dwMaxDataRate +2)
+			/* the reader has no baud rates table */
+			&& ((NULL == ccid_desc->arrayOfSupportedDataRates)
+			/* or explicitly support it */
+			|| find_baud_rate(baudrate, ccid_desc->arrayOfSupportedDataRates)))
+		{
+			best_baudrate = baudrate;
+			TA1 = atr->ib[0][ATR_INTERFACE_BYTE_TA].value;
+		}
+	}
+
+	/* restore original TA1 value */
+	atr->ib[0][ATR_INTERFACE_BYTE_TA].value = card_TA1;
+
+	if (TA1)
+	{
+		if (TA1 == card_TA1)
+			DEBUG_COMM2("Set speed to %d bauds", best_baudrate);
+		else
+			DEBUG_COMM3("Set adapted speed to %d bauds (TA1: 0x%02X)",
+				best_baudrate, TA1);
+	}
+	else
+		DEBUG_COMM2("Reader can't do more than %d bauds",
+			ccid_desc->dwMaxDataRate);
+
+	return TA1;
+} /* select_TA1 */
+
+
 static bool find_baud_rate(unsigned int baudrate, unsigned int *list)
 {
 	int i;
@@ -2311,6 +2742,74 @@ static unsigned int T1_card_timeout(double f, double d, int TC1,
 } /* T1_card_timeout  */
 
 
+/*
+ * Class indicator (TAi (i>2) after T=15) of the ATR, see ISO 7816-3
+ * bit 1: class A (5V), bit 2: class B (3V), bit 3: class C (1.8V)
+ * same bits as bVoltageSupport. 0 if not present.
+ */
+static int get_class_indicator(ATR_t *atr)
+{
+	int i, protocol = -1;
+
+	for (i=0; i<ATR_MAX_PROTOCOLS; i++)
+	{
+		/* TAi (i>2) present and protocol=15 => class indicator */
+		if (i >= 2 && protocol == 15
+			&& atr->ib[i][ATR_INTERFACE_BYTE_TA].present)
+			return atr->ib[i][ATR_INTERFACE_BYTE_TA].value & 0x07;
+
+		/* protocol T=? */
+		if (atr->ib[i][ATR_INTERFACE_BYTE_TD].present)
+			protocol = atr->ib[i][ATR_INTERFACE_BYTE_TD].value & 0x0F;
+	}
+
+	return 0;
+} /* get_class_indicator */
+
+
+/*
+ * Check the class of the power on against the class indicator of the
+ * ATR. If the card does not support the class used, return the voltage
+ * (VOLTAGE_*) of a class supported by the card and the reader. Return 0
+ * if no new activation is needed.
+ */
+static int select_voltage(_ccid_descriptor *ccid_descriptor,
+	unsigned char atr_buffer[], unsigned int atr_len)
+{
+	ATR_t atr;
+	int classes, used;
+
+	/* the reader selected the voltage */
+	if (ccid_descriptor->learnedVoltage <= 0)
+		return 0;
+
+	if (ATR_MALFORMED == ATR_InitFromArray(&atr, atr_buffer, atr_len))
+		return 0;
+
+	classes = get_class_indicator(&atr);
+	if (0 == classes)
+		return 0;
+
+	/* VOLTAGE_5V, VOLTAGE_3V and VOLTAGE_1_8V to class bit */
+	used = 1 << (ccid_descriptor->learnedVoltage - 1);
+	DEBUG_COMM3("Class indicator: 0x%02X, used: 0x%02X", classes, used);
+	if (classes & used)
+		return 0;
+
+	/* use the lowest voltage supported by the card and the reader */
+	classes &= ccid_descriptor->bVoltageSupport;
+	if (classes & 4)
+		return VOLTAGE_1_8V;
+	if (classes & 2)
+		return VOLTAGE_3V;
+	if (classes & 1)
+		return VOLTAGE_5V;
+
+	DEBUG_INFO1("No class supported by the card and the reader");
+	return 0;
+} /* select_voltage */
+
+
 static int get_IFSC(ATR_t *atr, int *idx)
 {
 	int i, ifsc, protocol = -1;
@@ -19,6 +19,7 @@
 #include "checksum.h"
 
 #include "ccid.h"
+#include "counters.h"
 
 #ifdef HAVE_STRING_H
 #include <string.h>
@@ -184,6 +185,10 @@ int t1_transceive(t1_state_t * t1, unsigned int dad,
 		unsigned char pcb;
 		int n;
 
+		/* the previous block is sent again */
+		if (retries < (int)t1->retries)
+			Counters[t1->lun].retries++;
+
 		retries--;
 
 		n = t1_xcv(t1, sdata, slen, sizeof(sdata));
@@ -484,6 +489,7 @@ int t1_transceive(t1_state_t * t1, unsigned int dad,
 				}
 
 				DEBUG_COMM2("CT sent S-block with wtx=%u", sdata[DATA]);
+				Counters[t1->lun].time_extensions++;
 				t1->wtx = sdata[DATA];
 				ct_buf_putc(&tbuf, sdata[DATA]);
 				break;
@@ -510,6 +516,7 @@ resync:
 
 		/* ISO 7816-3 Rule 6 */
 		resyncs--;
+		Counters[t1->lun].t1_resyncs++;
 		t1->ns = 0;
 		t1->nr = 0;
 		slen = t1_build(t1, sdata, dad, T1_S_BLOCK | T1_S_RESYNC, NULL,
@@ -25,6 +25,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include "defs.h"
@@ -56,6 +60,52 @@ static bool ccid_parse_interface_descriptor(libusb_device_handle *handle,
 	const struct libusb_interface *usb_interface,
 	FILE * fd);
 
+/* number of PC_to_RDR_GetSlotStatus sent to measure the throughput */
+#define JSON_SLOT_STATUS_COUNT 100
+
+/* a CCID interface to report with --json */
+struct json_job
+{
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *config_desc;
+	int num;
+	const struct libusb_interface *usb_interface;
+	int bus, address;
+	char *output;	/* JSON object of the interface */
+	size_t output_size;
+};
+
+/* interfaces [first, first+count[ of the same device */
+struct json_device
+{
+	struct json_job *jobs;
+	int first, count;
+	pthread_t thread;
+	bool threaded;
+};
+
+static void *json_parse_device(void *arg);
+
+/* a CCID interface read from a parse output (from the readers/ directory) */
+struct replay
+{
+	char name[256];	/* iManufacturer and iProduct */
+	unsigned int idVendor, idProduct, bcdDevice;
+	int bInterfaceNumber;
+	bool class_descriptor;	/* a CCID Class Descriptor was found */
+	unsigned char device_descriptor[0x36];
+	unsigned int clocks[256];	/* kHz */
+	int nb_clocks;
+	unsigned int rates[256];	/* bps */
+	int nb_rates;
+};
+
+static bool ccid_parse_class_descriptor(libusb_device_handle *handle,
+	int interface, const struct replay *replay,
+	const unsigned char *device_descriptor, FILE *fd);
+static int replay_files(int nb_files, char *files[], bool verbose);
+
 
 /*****************************************************************************
  *
@@ -69,11 +119,33 @@ int main(int argc, char *argv[])
 	unsigned char buffer[256];
 	bool class_ff = false;
 	ssize_t cnt;
-	FILE * fd;
+	FILE * fd = NULL;
 	gzFile zfd;
+	bool json = false;
+	bool verbose = false;
+	struct json_job *jobs = NULL;
+	int nb_jobs = 0;
 
-	if ((argc > 1) && (0 == strcmp(argv[1], "-p")))
-		class_ff = true;
+	for (i=1; i<argc; i++)
+	{
+		if (0 == strcmp(argv[i], "-p"))
+			class_ff = true;
+		else if (0 == strcmp(argv[i], "-v"))
+			verbose = true;
+		else if (0 == strcmp(argv[i], "--json"))
+			json = true;
+		else if (0 == strcmp(argv[i], "--replay"))
+			/* no reader used, the dumps are the remaining arguments */
+			return replay_files(argc-i-1, argv+i+1, verbose);
+		else
+		{
+			(void)fprintf(stderr,
+				"Usage: %s [-p] [--json]\n"
+				"       %s [-v] --replay file...\n",
+				argv[0], argv[0]);
+			return 1;
+		}
+	}
 
 	r = libusb_init(NULL);
 	if (r < 0)
@@ -90,11 +162,14 @@ int main(int argc, char *argv[])
 		return (int)cnt;
 	}
 
-	fd = fopen(OUTPUT_FILENAME, "rw");
-	if (NULL == fd)
+	if (! json)
 	{
-		perror("fopen " OUTPUT_FILENAME);
-		return -1;
+		fd = fopen(OUTPUT_FILENAME, "rw");
+		if (NULL == fd)
+		{
+			perror("fopen " OUTPUT_FILENAME);
+			return -1;
+		}
 	}
 
 	/* for every device */
@@ -232,12 +307,38 @@ again:
 		}
 #endif
 
-		(void)ccid_parse_interface_descriptor(handle, desc, config_desc, num,
-			usb_interface, fd);
+		if (json)
+		{
+			struct json_job *new_jobs;
+
+			/* the interface is parsed later, in parallel with the
+			 * other devices, and stays claimed until then */
+			new_jobs = realloc(jobs, (nb_jobs+1) * sizeof *jobs);
+			if (NULL == new_jobs)
+			{
+				perror("realloc");
+				return -1;
+			}
+			jobs = new_jobs;
+			jobs[nb_jobs].handle = handle;
+			jobs[nb_jobs].desc = desc;
+			jobs[nb_jobs].config_desc = config_desc;
+			jobs[nb_jobs].num = num;
+			jobs[nb_jobs].usb_interface = usb_interface;
+			jobs[nb_jobs].bus = libusb_get_bus_number(dev);
+			jobs[nb_jobs].address = libusb_get_device_address(dev);
+			jobs[nb_jobs].output = NULL;
+			jobs[nb_jobs].output_size = 0;
+			nb_jobs++;
+		}
+		else
+			(void)ccid_parse_interface_descriptor(handle, desc, config_desc,
+				num, usb_interface, fd);
 		nb++;
 
 #ifndef __APPLE__
-		(void)libusb_release_interface(handle, interface);
+		if (! json)
+			(void)libusb_release_interface(handle, interface);
 #endif
 		/* check for another CCID interface on the same device */
 		num++;
@@ -248,6 +349,70 @@ again:
 		(void)fprintf(stderr,
 			"Can't find any CCID device.\nMaybe you must run parse as root?\n");
 
+	if (json)
+	{
+		struct json_device *devices;
+		int nb_devices = 0;
+
+		/* one thread per device. The interfaces of a composite device
+		 * are parsed in sequence by the same thread since they share
+		 * the libusb handle */
+		devices = calloc(nb_jobs ? nb_jobs : 1, sizeof *devices);
+		if (NULL == devices)
+		{
+			perror("calloc");
+			return -1;
+		}
+		for (i=0; i<nb_jobs; i++)
+		{
+			if ((0 == i) || (jobs[i].handle != jobs[i-1].handle))
+			{
+				devices[nb_devices].jobs = jobs;
+				devices[nb_devices].first = i;
+				nb_devices++;
+			}
+			devices[nb_devices-1].count++;
+		}
+
+		for (i=0; i<nb_devices; i++)
+		{
+			r = pthread_create(&devices[i].thread, NULL, json_parse_device,
+				&devices[i]);
+			if (r)
+			{
+				/* parse it from here instead */
+				(void)fprintf(stderr, "pthread_create: %s\n", strerror(r));
+				(void)json_parse_device(&devices[i]);
+			}
+			else
+				devices[i].threaded = true;
+		}
+
+		for (i=0; i<nb_devices; i++)
+			if (devices[i].threaded)
+				(void)pthread_join(devices[i].thread, NULL);
+
+		/* same order as the text output */
+		(void)printf("[");
+		for (i=0; i<nb_jobs; i++)
+		{
+			(void)printf("%s\n%s", i ? "," : "",
+				jobs[i].output ? jobs[i].output : "{}");
+			free(jobs[i].output);
+#ifndef __APPLE__
+			(void)libusb_release_interface(jobs[i].handle,
+				jobs[i].usb_interface->altsetting->bInterfaceNumber);
+#endif
+		}
+		(void)printf("\n]\n");
+
+		free(devices);
+		free(jobs);
+		libusb_exit(NULL);
+
+		return 0;
+	}
+
 	libusb_exit(NULL);
 
 	printf("\n");
@@ -406,9 +571,77 @@ static bool ccid_parse_interface_descriptor(libusb_device_handle *handle,
 		return true;
 	}
 
-	/*
-	 * CCID Class Descriptor
-	 */
+	return ccid_parse_class_descriptor(handle,
+		usb_interface_descriptor->bInterfaceNumber, NULL, device_descriptor,
+		fd);
+} /* ccid_parse_interface_descriptor */
+
+
+/*****************************************************************************
+ *
+ *					class_request
+ *
+ * GET CLOCK FREQUENCIES or GET DATA RATES sent to the reader, or
+ * answered from a replayed dump if replay is not NULL
+ *
+ ****************************************************************************/
+static int class_request(libusb_device_handle *handle,
+	const struct replay *replay, int request, int interface,
+	unsigned char *buffer, int length)
+{
+	const unsigned int *values;
+	int i, nb;
+
+	if (NULL == replay)
+		return libusb_control_transfer(handle,
+			0xA1, /* request type */
+			request,
+			0x00, /* value */
+			interface,
+			buffer,
+			length,
+			2 * 1000);
+
+	if (0x02 == request)
+	{
+		values = replay->clocks;
+		nb = replay->nb_clocks;
+	}
+	else
+	{
+		values = replay->rates;
+		nb = replay->nb_rates;
+	}
+
+	if (0 == nb)
+	{
+		errno = 0;
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	for (i=0; (i<nb) && ((i+1)*4 <= length); i++)
+	{
+		buffer[i*4] = values[i] & 0xFF;
+		buffer[i*4+1] = (values[i] >> 8) & 0xFF;
+		buffer[i*4+2] = (values[i] >> 16) & 0xFF;
+		buffer[i*4+3] = values[i] >> 24;
+	}
+
+	return i*4;
+} /* class_request */
+
+
+/*****************************************************************************
+ *
+ *					Parse a CCID Class Descriptor
+ *
+ ****************************************************************************/
+static bool ccid_parse_class_descriptor(libusb_device_handle *handle,
+	int interface, const struct replay *replay,
+	const unsigned char *device_descriptor, FILE *fd)
+{
+	unsigned char buffer[256*sizeof(int)];  /* maximum is 256 records */
+
 	(void)fprintf(fd, " CCID Class Descriptor\n");
 
 	(void)fprintf(fd, "  bLength: 0x%02X\n", device_descriptor[0]);
@@ -460,14 +693,11 @@ static bool ccid_parse_interface_descriptor(libusb_device_handle *handle,
 			bNumClockSupported = sizeof(buffer) / sizeof(int);
 
 		/* See CCID 5.3.2 page 24 */
-		n = libusb_control_transfer(handle,
-			0xA1, /* request type */
+		n = class_request(handle, replay,
 			0x02, /* GET CLOCK FREQUENCIES */
-			0x00, /* value */
-			usb_interface_descriptor->bInterfaceNumber, /* interface */
+			interface,
 			buffer,
-			bNumClockSupported * sizeof(int),
-			2 * 1000);
+			bNumClockSupported * sizeof(int));
 
 		/* we got an error? */
 		if (n <= 0)
@@ -520,14 +750,11 @@ static bool ccid_parse_interface_descriptor(libusb_device_handle *handle,
 			n_max = bNumDataRatesSupported;
 
 		/* See CCID 5.3.3 page 24 */
-		n = libusb_control_transfer(handle,
-			0xA1, /* request type */
+		n = class_request(handle, replay,
 			0x03, /* GET DATA RATES */
-			0x00, /* value */
-			usb_interface_descriptor->bInterfaceNumber, /* interface */
+			interface,
 			buffer,
-			n_max * sizeof(int),
-			2 * 1000);
+			n_max * sizeof(int));
 
 		/* we got an error? */
 		if (n <= 0)
@@ -644,5 +871,557 @@ static bool ccid_parse_interface_descriptor(libusb_device_handle *handle,
 	(void)fprintf(fd, "  bMaxCCIDBusySlots: %d\n", device_descriptor[53]);
 
 	return false;
-} /* ccid_parse_interface_descriptor */
+} /* ccid_parse_class_descriptor */
+
+
+/*****************************************************************************
+ *
+ *					json_now
+ *
+ ****************************************************************************/
+static unsigned long long json_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+} /* json_now */
+
+
+/*****************************************************************************
+ *
+ *					json_string
+ *
+ ****************************************************************************/
+static void json_string(FILE *out, const unsigned char *s)
+{
+	(void)fputc('"', out);
+	for (; *s; s++)
+	{
+		if (('"' == *s) || ('\\' == *s))
+			(void)fprintf(out, "\\%c", *s);
+		else
+			if ((*s < 0x20) || (*s > 0x7E))
+				(void)fprintf(out, "\\u%04X", *s);
+			else
+				(void)fputc(*s, out);
+	}
+	(void)fputc('"', out);
+} /* json_string */
+
+
+/*****************************************************************************
+ *
+ *					json_usb_string
+ *
+ ****************************************************************************/
+static void json_usb_string(FILE *out, libusb_device_handle *handle,
+	const char *name, int index)
+{
+	unsigned char buffer[256];
+	unsigned long long start;
+	int r;
+
+	start = json_now();
+	r = libusb_get_string_descriptor_ascii(handle, index, buffer,
+		sizeof(buffer));
+	(void)fprintf(out, ",\n  \"%s\": ", name);
+	if (r < 0)
+		(void)fprintf(out, "null");
+	else
+		json_string(out, buffer);
+	(void)fprintf(out, ",\n  \"%s_time_us\": %llu", name, json_now() - start);
+} /* json_usb_string */
+
+
+/*****************************************************************************
+ *
+ *					json_control_list
+ *
+ * GET CLOCK FREQUENCIES or GET DATA RATES as a list of values.
+ * bNum is the number of values announced in the CCID descriptor
+ *
+ ****************************************************************************/
+static void json_control_list(FILE *out, libusb_device_handle *handle,
+	int interface, int request, const char *name, int bNum)
+{
+	unsigned char buffer[256*sizeof(int)];  /* maximum is 256 records */
+	unsigned long long start;
+	int n, n_max, i;
+
+	if (0 == bNum)
+		/* read up to the buffer size */
+		n_max = sizeof(buffer) / sizeof(int);
+	else
+		n_max = bNum;
+
+	start = json_now();
+	n = libusb_control_transfer(handle,
+		0xA1, /* request type */
+		request,
+		0x00, /* value */
+		interface,
+		buffer,
+		n_max * sizeof(int),
+		2 * 1000);
+
+	(void)fprintf(out, ",\n   \"%s_time_us\": %llu", name, json_now() - start);
+	(void)fprintf(out, ",\n   \"%s\": ", name);
+
+	/* not supported or not a multiple of 4 */
+	if ((n <= 0) || (n % 4))
+	{
+		(void)fprintf(out, "null");
+		return;
+	}
+
+#ifndef DISPLAY_EXTRA_VALUES
+	/* we got more data than expected */
+	if (bNum && (n > bNum*4))
+		n = bNum*4;
+#endif
+
+	(void)fprintf(out, "[");
+	for (i=0; i<n; i+=4)
+		(void)fprintf(out, "%s%d", i ? ", " : "", dw2i(buffer, i));
+	(void)fprintf(out, "]");
+} /* json_control_list */
+
+
+/*****************************************************************************
+ *
+ *					json_slot_status
+ *
+ * Round trip time of the bulk pipes using PC_to_RDR_GetSlotStatus. The
+ * command does not change the state of the reader nor of the card.
+ * The 10 bytes command and response measure the latency of the reader,
+ * not the throughput of the pipes.
+ *
+ ****************************************************************************/
+static void json_slot_status(FILE *out, libusb_device_handle *handle,
+	const struct libusb_interface_descriptor *usb_interface_descriptor)
+{
+	unsigned char bulk_in = 0, bulk_out = 0;
+	unsigned long long start, elapsed;
+	bool pending = false;
+	int i;
+
+	for (i=0; i<usb_interface_descriptor->bNumEndpoints; i++)
+	{
+		const struct libusb_endpoint_descriptor *endpoint =
+			&usb_interface_descriptor->endpoint[i];
+
+		if ((endpoint->bmAttributes & 0x03) != LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+
+		if (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			bulk_in = endpoint->bEndpointAddress;
+		else
+			bulk_out = endpoint->bEndpointAddress;
+	}
+
+	(void)fprintf(out, ",\n  \"slot_status_rtt\": ");
+
+	/* maybe the device with Class = 0xFF (-p) is NOT a CCID reader:
+	 * do not send it CCID commands.
+	 * ICCD devices do not use bulk pipes */
+	if ((usb_interface_descriptor->bInterfaceClass != 0x0B)
+		|| (usb_interface_descriptor->bInterfaceProtocol != 0)
+		|| (0 == bulk_in) || (0 == bulk_out))
+	{
+		(void)fprintf(out, "null");
+		return;
+	}
+
+	start = json_now();
+	for (i=0; i<JSON_SLOT_STATUS_COUNT; i++)
+	{
+		unsigned char cmd[10] = { 0x65 };	/* PC_to_RDR_GetSlotStatus */
+		unsigned char res[64];
+		int r, length;
+
+		cmd[6] = i;	/* bSeq */
+
+		r = libusb_bulk_transfer(handle, bulk_out, cmd, sizeof cmd, &length,
+			2 * 1000);
+		if ((r < 0) || (length != sizeof cmd))
+			break;
+
+		r = libusb_bulk_transfer(handle, bulk_in, res, sizeof res, &length,
+			2 * 1000);
+		if ((r < 0) || (length < 10) || (res[0] != 0x81) || (res[6] != i))
+		{
+			/* the response to the command may still come */
+			pending = true;
+			break;
+		}
+	}
+	elapsed = json_now() - start;
+
+	/* do not leave a frame in the bulk in pipe for the next user of
+	 * the reader */
+	if (pending)
+	{
+		unsigned char res[64];
+		int r, length, n;
+
+		for (n=0; n<JSON_SLOT_STATUS_COUNT; n++)
+		{
+			r = libusb_bulk_transfer(handle, bulk_in, res, sizeof res,
+				&length, 100);
+			if (r < 0)
+				break;
+		}
+	}
+
+	(void)fprintf(out, "{ \"count\": %d, \"time_us\": %llu, \"rtt_us\": %.1f }",
+		i, elapsed, i ? (double)elapsed / i : 0.0);
+} /* json_slot_status */
+
+
+/*****************************************************************************
+ *
+ *					json_parse_interface
+ *
+ ****************************************************************************/
+static void json_parse_interface(struct json_job *job, FILE *out)
+{
+	const struct libusb_interface_descriptor *usb_interface_descriptor;
+	const unsigned char *device_descriptor;
+	libusb_device_handle *handle = job->handle;
+	unsigned long long start = json_now();
+	int num = job->num;
+
+	usb_interface_descriptor = get_ccid_usb_interface(job->config_desc,
+		&num)->altsetting;
+
+	(void)fprintf(out, " {\n  \"bus\": %d,\n  \"address\": %d",
+		job->bus, job->address);
+	(void)fprintf(out, ",\n  \"idVendor\": %d", job->desc.idVendor);
+	json_usb_string(out, handle, "iManufacturer", job->desc.iManufacturer);
+	(void)fprintf(out, ",\n  \"idProduct\": %d", job->desc.idProduct);
+	json_usb_string(out, handle, "iProduct", job->desc.iProduct);
+	(void)fprintf(out, ",\n  \"bcdDevice\": \"%X.%02X\"",
+		job->desc.bcdDevice >> 8, job->desc.bcdDevice & 0xFF);
+
+	(void)fprintf(out, ",\n  \"bLength\": %d", usb_interface_descriptor->bLength);
+	(void)fprintf(out, ",\n  \"bDescriptorType\": %d", usb_interface_descriptor->bDescriptorType);
+	(void)fprintf(out, ",\n  \"bInterfaceNumber\": %d", usb_interface_descriptor->bInterfaceNumber);
+	(void)fprintf(out, ",\n  \"bAlternateSetting\": %d", usb_interface_descriptor->bAlternateSetting);
+	(void)fprintf(out, ",\n  \"bNumEndpoints\": %d", usb_interface_descriptor->bNumEndpoints);
+	(void)fprintf(out, ",\n  \"bInterfaceClass\": %d", usb_interface_descriptor->bInterfaceClass);
+	(void)fprintf(out, ",\n  \"bInterfaceSubClass\": %d", usb_interface_descriptor->bInterfaceSubClass);
+	(void)fprintf(out, ",\n  \"bInterfaceProtocol\": %d", usb_interface_descriptor->bInterfaceProtocol);
+	json_usb_string(out, handle, "iInterface", usb_interface_descriptor->iInterface);
+
+	/*
+	 * CCID Class Descriptor
+	 */
+	(void)fprintf(out, ",\n  \"ccid\": ");
+	device_descriptor = get_ccid_device_descriptor(job->usb_interface);
+	if ((NULL == device_descriptor) || (device_descriptor[0] != 0x36))
+		(void)fprintf(out, "null");
+	else
+	{
+		(void)fprintf(out, "{\n   \"bLength\": %d", device_descriptor[0]);
+		(void)fprintf(out, ",\n   \"bDescriptorType\": %d", device_descriptor[1]);
+		(void)fprintf(out, ",\n   \"bcdCCID\": \"%X.%02X\"", device_descriptor[3], device_descriptor[2]);
+		(void)fprintf(out, ",\n   \"bMaxSlotIndex\": %d", device_descriptor[4]);
+		(void)fprintf(out, ",\n   \"bVoltageSupport\": %d", device_descriptor[5]);
+		(void)fprintf(out, ",\n   \"dwProtocols\": %u", (unsigned int)dw2i(device_descriptor, 6));
+		(void)fprintf(out, ",\n   \"dwDefaultClock\": %d", dw2i(device_descriptor, 10));
+		(void)fprintf(out, ",\n   \"dwMaximumClock\": %d", dw2i(device_descriptor, 14));
+		(void)fprintf(out, ",\n   \"bNumClockSupported\": %d", device_descriptor[18]);
+		/* See CCID 5.3.2 page 24 */
+		json_control_list(out, handle, usb_interface_descriptor->bInterfaceNumber,
+			0x02, "clock_frequencies", device_descriptor[18]);
+		(void)fprintf(out, ",\n   \"dwDataRate\": %d", dw2i(device_descriptor, 19));
+		(void)fprintf(out, ",\n   \"dwMaxDataRate\": %d", dw2i(device_descriptor, 23));
+		(void)fprintf(out, ",\n   \"bNumDataRatesSupported\": %d", device_descriptor[27]);
+		/* See CCID 5.3.3 page 24 */
+		json_control_list(out, handle, usb_interface_descriptor->bInterfaceNumber,
+			0x03, "data_rates", device_descriptor[27]);
+		(void)fprintf(out, ",\n   \"dwMaxIFSD\": %d", dw2i(device_descriptor, 28));
+		(void)fprintf(out, ",\n   \"dwSynchProtocols\": %u", (unsigned int)dw2i(device_descriptor, 32));
+		(void)fprintf(out, ",\n   \"dwMechanical\": %u", (unsigned int)dw2i(device_descriptor, 36));
+		(void)fprintf(out, ",\n   \"dwFeatures\": %u", (unsigned int)dw2i(device_descriptor, 40));
+		(void)fprintf(out, ",\n   \"dwMaxCCIDMessageLength\": %d", dw2i(device_descriptor, 44));
+		(void)fprintf(out, ",\n   \"bClassGetResponse\": %d", device_descriptor[48]);
+		(void)fprintf(out, ",\n   \"bClassEnvelope\": %d", device_descriptor[49]);
+		(void)fprintf(out, ",\n   \"wLcdLayout\": %d", (device_descriptor[51] << 8)+device_descriptor[50]);
+		(void)fprintf(out, ",\n   \"bPINSupport\": %d", device_descriptor[52]);
+		(void)fprintf(out, ",\n   \"bMaxCCIDBusySlots\": %d", device_descriptor[53]);
+		(void)fprintf(out, "\n  }");
+	}
+
+	json_slot_status(out, handle, usb_interface_descriptor);
+
+	(void)fprintf(out, ",\n  \"total_time_us\": %llu\n }", json_now() - start);
+} /* json_parse_interface */
+
+
+/*****************************************************************************
+ *
+ *					json_parse_device
+ *
+ ****************************************************************************/
+static void *json_parse_device(void *arg)
+{
+	struct json_device *device = arg;
+	int i;
+
+	for (i=device->first; i<device->first + device->count; i++)
+	{
+		struct json_job *job = &device->jobs[i];
+		FILE *out;
+
+		out = open_memstream(&job->output, &job->output_size);
+		if (NULL == out)
+		{
+			perror("open_memstream");
+			continue;
+		}
+
+		json_parse_interface(job, out);
+		(void)fclose(out);
+	}
+
+	return NULL;
+} /* json_parse_device */
+
+
+/* CCID Class Descriptor fields as written by ccid_parse_class_descriptor() */
+static const struct
+{
+	const char *format;	/* sscanf() format of the line */
+	int offset;	/* in the CCID Class Descriptor */
+	int size;	/* in bytes */
+} ReplayFields[] = {
+	{ "bLength: 0x%X", 0, 1 },
+	{ "bDescriptorType: 0x%X", 1, 1 },
+	{ "bMaxSlotIndex: 0x%X", 4, 1 },
+	{ "bVoltageSupport: 0x%X", 5, 1 },
+	{ "bNumClockSupported: %u", 18, 1 },
+	{ "dwDataRate: %u bps", 19, 4 },
+	{ "dwMaxDataRate: %u bps", 23, 4 },
+	{ "bNumDataRatesSupported: %u", 27, 1 },
+	{ "dwMaxIFSD: %u", 28, 4 },
+	{ "dwSynchProtocols: 0x%X", 32, 4 },
+	{ "dwMechanical: 0x%X", 36, 4 },
+	{ "dwFeatures: 0x%X", 40, 4 },
+	{ "dwMaxCCIDMessageLength: %u bytes", 44, 4 },
+	{ "bClassGetResponse: 0x%X", 48, 1 },
+	{ "bClassEnvelope: 0x%X", 49, 1 },
+	{ "wLcdLayout: 0x%X", 50, 2 },
+	{ "bPINSupport: 0x%X", 52, 1 },
+	{ "bMaxCCIDBusySlots: %u", 53, 1 },
+};
+
+/*****************************************************************************
+ *
+ *					replay_set
+ *
+ ****************************************************************************/
+static void replay_set(struct replay *replay, int offset, int size,
+	unsigned int value)
+{
+	int i;
+
+	for (i=0; i<size; i++)
+		replay->device_descriptor[offset+i] = (value >> (8*i)) & 0xFF;
+} /* replay_set */
+
+
+/*****************************************************************************
+ *
+ *					replay_line
+ *
+ * Update the replayed interface with a line of the parse output
+ *
+ ****************************************************************************/
+static void replay_line(struct replay *replay, const char *line)
+{
+	unsigned int a, b;
+	char unit[4];
+	float clock;
+	size_t i;
+
+	/* the fields are identified by their name */
+	while (' ' == *line)
+		line++;
+
+	if (! replay->class_descriptor)
+	{
+		if (1 == sscanf(line, "idVendor: 0x%X", &a))
+			replay->idVendor = a;
+		else if (1 == sscanf(line, "idProduct: 0x%X", &a))
+			replay->idProduct = a;
+		else if (2 == sscanf(line, "bcdDevice: %X.%X", &a, &b))
+			replay->bcdDevice = (a << 8) + b;
+		else if (1 == sscanf(line, "bInterfaceNumber: %u", &a))
+			replay->bInterfaceNumber = a;
+		else if ((0 == strncmp(line, "iManufacturer: ", 15))
+			|| (0 == strncmp(line, "iProduct: ", 10)))
+		{
+			size_t len = strlen(replay->name);
+
+			line = strchr(line, ' ');
+			while (' ' == *line)
+				line++;
+			(void)snprintf(replay->name + len, sizeof replay->name - len,
+				"%s%s", len ? " " : "", line);
+		}
+		else if (0 == strcmp(line, "CCID Class Descriptor"))
+			replay->class_descriptor = true;
+
+		return;
+	}
+
+	for (i=0; i<sizeof(ReplayFields)/sizeof(ReplayFields[0]); i++)
+		if (1 == sscanf(line, ReplayFields[i].format, &a))
+		{
+			replay_set(replay, ReplayFields[i].offset, ReplayFields[i].size, a);
+			return;
+		}
+
+	if (2 == sscanf(line, "bcdCCID: %X.%X", &a, &b))
+		replay_set(replay, 2, 2, (a << 8) + b);
+	else if (2 == sscanf(line, "dwProtocols: 0x%X 0x%X", &a, &b))
+		replay_set(replay, 6, 4, (a << 16) + b);
+	else if (1 == sscanf(line, "dwDefaultClock: %f MHz", &clock))
+		replay_set(replay, 10, 4, clock * 1000 + 0.5);
+	else if (1 == sscanf(line, "dwMaximumClock: %f MHz", &clock))
+		replay_set(replay, 14, 4, clock * 1000 + 0.5);
+	else if (2 == sscanf(line, "Support %u %3s", &a, unit))
+	{
+		if ((0 == strcmp(unit, "kHz"))
+			&& (replay->nb_clocks < (int)(sizeof replay->clocks / sizeof replay->clocks[0])))
+			replay->clocks[replay->nb_clocks++] = a;
+
+		if ((0 == strcmp(unit, "bps"))
+			&& (replay->nb_rates < (int)(sizeof replay->rates / sizeof replay->rates[0])))
+			replay->rates[replay->nb_rates++] = a;
+	}
+} /* replay_line */
+
+
+/*****************************************************************************
+ *
+ *					replay_summary
+ *
+ * Print the capabilities of a replayed interface as a C table entry
+ *
+ ****************************************************************************/
+static void replay_summary(const struct replay *replay, const char *file,
+	bool verbose)
+{
+	const unsigned char *device_descriptor = replay->device_descriptor;
+	const char *exchange;
+	char buffer[sizeof "0x00000000"];
+
+	if (verbose)
+	{
+		(void)fprintf(stderr, "%s: interface %d\n", file,
+			replay->bInterfaceNumber);
+		(void)ccid_parse_class_descriptor(NULL, replay->bInterfaceNumber,
+			replay, device_descriptor, stderr);
+	}
+
+	switch (dw2i(device_descriptor, 40) & CCID_CLASS_EXCHANGE_MASK)
+	{
+		case CCID_CLASS_CHARACTER:
+			exchange = "CCID_CLASS_CHARACTER";
+			break;
+
+		case CCID_CLASS_TPDU:
+			exchange = "CCID_CLASS_TPDU";
+			break;
+
+		case CCID_CLASS_SHORT_APDU:
+			exchange = "CCID_CLASS_SHORT_APDU";
+			break;
+
+		case CCID_CLASS_EXTENDED_APDU:
+			exchange = "CCID_CLASS_EXTENDED_APDU";
+			break;
+
+		default:
+			(void)snprintf(buffer, sizeof buffer, "0x%08X",
+				dw2i(device_descriptor, 40) & CCID_CLASS_EXCHANGE_MASK);
+			exchange = buffer;
+	}
+
+	(void)printf("\t{ 0x%04X, 0x%04X, 0x%04X, %d, %s, %u, %u, %d },\t/* %s */\n",
+		replay->idVendor, replay->idProduct, replay->bcdDevice,
+		replay->bInterfaceNumber, exchange, dw2i(device_descriptor, 44),
+		dw2i(device_descriptor, 28), device_descriptor[53], replay->name);
+} /* replay_summary */
+
+
+/*****************************************************************************
+ *
+ *					replay_files
+ *
+ * Replay parse outputs (readers/ directory or output.bin) instead of using
+ * the connected readers. One table entry is printed per CCID interface.
+ *
+ ****************************************************************************/
+static int replay_files(int nb_files, char *files[], bool verbose)
+{
+	int i, nb = 0;
+
+	if (0 == nb_files)
+	{
+		(void)fprintf(stderr, "No file to replay\n");
+		return 1;
+	}
+
+	(void)printf("\t/* idVendor, idProduct, bcdDevice, bInterfaceNumber, "
+		"exchange level, dwMaxCCIDMessageLength, dwMaxIFSD, "
+		"bMaxCCIDBusySlots */\n");
+
+	for (i=0; i<nb_files; i++)
+	{
+		struct replay replay;
+		char line[256];
+		gzFile zfd;
+
+		/* gzread() also reads uncompressed files */
+		zfd = gzopen(files[i], "rb");
+		if (NULL == zfd)
+		{
+			perror(files[i]);
+			return 1;
+		}
+
+		memset(&replay, 0, sizeof replay);
+		while (gzgets(zfd, line, sizeof line))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+
+			/* a new interface */
+			if ((0 == strncmp(line, " idVendor: ", 11))
+				&& replay.class_descriptor)
+			{
+				replay_summary(&replay, files[i], verbose);
+				nb++;
+				memset(&replay, 0, sizeof replay);
+			}
+
+			replay_line(&replay, line);
+		}
+		(void)gzclose(zfd);
+
+		if (replay.class_descriptor)
+		{
+			replay_summary(&replay, files[i], verbose);
+			nb++;
+		}
+	}
+
+	(void)fprintf(stderr, "%d CCID interfaces replayed from %d files\n",
+		nb, nb_files);
+
+	return 0;
+} /* replay_files */
 
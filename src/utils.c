@@ -18,6 +18,7 @@
 */
 
 #include <string.h>
+#include <time.h>
 #include <pcsclite.h>
 
 #include <config.h>
@@ -140,3 +141,13 @@ void p_bswap_32(void *ptr)
 	array[1] = array[2];
 	array[2] = tmp;
 }
+
+/* monotonic time in micro seconds */
+uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -28,3 +28,5 @@ void set_U16(void *, uint16_t);
 void set_U32(void *, uint32_t);
 void p_bswap_16(void *ptr);
 void p_bswap_32(void *ptr);
+
+uint64_t get_time_us(void);